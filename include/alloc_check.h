@@ -10,6 +10,8 @@
 /**
  * Notes:
  * alloc_check will call exit(72) in case any of it's internal systems fails to execute correctly
+ * When malloc fails, internal structures fall back to a reserved pool of META_POOL_SIZE bytes,
+ * exit(72) is only called once that pool is exhausted as well
  */
 
 #ifndef ALLOC_CHECK_H
@@ -19,19 +21,87 @@
 #include <stddef.h>
 
 
+//Tracking levels, selected at compile time, anything a level does not use is compiled out
+//Off forwards to the standard functions, counters only keeps per-callsite counters,
+//summary adds the live block set, full adds block histories and stacks adds return addresses
+#define ALLOC_CHECK_LEVEL_OFF 0
+#define ALLOC_CHECK_LEVEL_COUNTERS 1
+#define ALLOC_CHECK_LEVEL_SUMMARY 2
+#define ALLOC_CHECK_LEVEL_FULL 3
+#define ALLOC_CHECK_LEVEL_STACKS 4
+
+//Report orders, callsite orders group missing frees by where they were allocated
+#define ALLOC_CHECK_ORDER_AGE 0 //Oldest block first, the default
+#define ALLOC_CHECK_ORDER_SIZE 1 //Largest first
+#define ALLOC_CHECK_ORDER_COUNT 2 //Callsites with the most blocks first
+#define ALLOC_CHECK_ORDER_CALLSITE 3 //Callsites by file name and line
+
+//Must match the level the linked library variant was built with
+#ifndef ALLOC_CHECK_LEVEL
+#define ALLOC_CHECK_LEVEL ALLOC_CHECK_LEVEL_FULL
+#endif
+
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF && !defined(USE_STANDARD_MEM)
+#define USE_STANDARD_MEM
+#endif
+
+
+//Passed as the line when the file name is a return address
+#define CHKD_RETURN_ADDRESS_LINE -1
+
 #ifdef USE_STANDARD_MEM
 #include <stdlib.h>
 #define CHKD_MALLOC(size) malloc(size)
 #define CHKD_CALLOC(nitems, size) calloc(nitems, size)
 #define CHKD_REALLOC(ptr, size) realloc(ptr, size)
 #define CHKD_FREE(ptr) free(ptr);
+#define CHKD_MALLOC_RA_N(size, depth) malloc(size)
+#define CHKD_CALLOC_RA_N(nitems, size, depth) calloc(nitems, size)
+#define CHKD_REALLOC_RA_N(ptr, size, depth) realloc(ptr, size)
+#define CHKD_FREE_RA_N(ptr, depth) free(ptr);
+#define CHKD_MALLOC_BATCH(count, size, out) standard_malloc_batch(count, size, out)
+#define CHKD_FREE_BATCH(ptrs, count) standard_free_batch(ptrs, count)
+#define CHKD_NEW_ARRAY(T, count) ((T *)calloc(count, sizeof(T)))
+
+static inline size_t standard_malloc_batch(size_t count, size_t size, void **out)
+{
+	size_t allocated = 0;
+	for (size_t i = 0; i < count; i++)
+		if ((out[i] = malloc(size)) != NULL) allocated++;
+	return allocated;
+}
+
+static inline void standard_free_batch(void **ptrs, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		free(ptrs[i]);
+}
 #else
 #define CHKD_MALLOC(size) checked_malloc(size, __FILE__, __LINE__)
 #define CHKD_CALLOC(nitems, size) checked_calloc(nitems, size, __FILE__, __LINE__)
 #define CHKD_REALLOC(ptr, size) checked_realloc(ptr, size, __FILE__, __LINE__)
 #define CHKD_FREE(ptr) checked_free(ptr, __FILE__, __LINE__)
+#define CHKD_MALLOC_RA_N(size, depth) checked_malloc(size, (char *)__builtin_return_address(depth), CHKD_RETURN_ADDRESS_LINE)
+#define CHKD_CALLOC_RA_N(nitems, size, depth) checked_calloc(nitems, size, (char *)__builtin_return_address(depth), CHKD_RETURN_ADDRESS_LINE)
+#define CHKD_REALLOC_RA_N(ptr, size, depth) checked_realloc(ptr, size, (char *)__builtin_return_address(depth), CHKD_RETURN_ADDRESS_LINE)
+#define CHKD_FREE_RA_N(ptr, depth) checked_free(ptr, (char *)__builtin_return_address(depth), CHKD_RETURN_ADDRESS_LINE)
+#define CHKD_MALLOC_BATCH(count, size, out) checked_malloc_batch(count, size, out, __FILE__, __LINE__)
+#define CHKD_FREE_BATCH(ptrs, count) checked_free_batch(ptrs, count, __FILE__, __LINE__)
+#define CHKD_NEW_ARRAY(T, count) ((T *)({ static chkd_type chkd_type_desc = { #T, sizeof(T) }; \
+	checked_new(&chkd_type_desc, count, __FILE__, __LINE__); }))
 #endif
 
+//Zeroed like calloc, counted per type as well as per callsite
+#define CHKD_NEW(T) CHKD_NEW_ARRAY(T, 1)
+
+//For use inside allocation wrappers, the wrapper's caller is recorded instead of __FILE__:__LINE__
+//'depth' counts further frames up and must be a constant, wrappers should not be inlined
+//A depth above 0 needs -fno-omit-frame-pointer, and GCC warns about it with -Wframe-address
+#define CHKD_MALLOC_RA(size) CHKD_MALLOC_RA_N(size, 0)
+#define CHKD_CALLOC_RA(nitems, size) CHKD_CALLOC_RA_N(nitems, size, 0)
+#define CHKD_REALLOC_RA(ptr, size) CHKD_REALLOC_RA_N(ptr, size, 0)
+#define CHKD_FREE_RA(ptr) CHKD_FREE_RA_N(ptr, 0)
+
 
 #ifndef ALLOW_STANDARD_MEM
 //Poison identifiers to prevent their use
@@ -43,9 +113,125 @@ void *checked_malloc(size_t size, char *file_name, int line);
 void *checked_calloc(size_t nitems, size_t size, char *file_name, int line);
 void *checked_realloc(void *ptr, size_t size, char *file_name, int line);
 void checked_free(void *ptr, char *file_name, int line);
+//'count' blocks of 'size' bytes into 'out' (NULL where malloc failed), recorded in one pass, returns how many succeeded
+size_t checked_malloc_batch(size_t count, size_t size, void **out, char *file_name, int line);
+void checked_free_batch(void **ptrs, size_t count, char *file_name, int line);
+
+//Static descriptor behind each CHKD_NEW, types with the same name and size share their statistics
+typedef struct
+{
+	const char *name;
+	size_t size;
+} chkd_type;
+
+//'count' zeroed objects of 'type', recorded as one calloc
+void *checked_new(chkd_type *type, size_t count, char *file_name, int line);
+
+//Tracked pool, blocks are counted per pool and only released together by destroying it
+//A pool must only be used by one thread at a time, pools never destroyed show up in reports
+typedef struct chkd_pool chkd_pool;
+#define CHKD_POOL_CREATE(name) chkd_pool_create(name, __FILE__, __LINE__)
+chkd_pool *chkd_pool_create(char *name, char *file_name, int line);
+//16-byte aligned, NULL if no chunk could be allocated
+void *chkd_pool_alloc(chkd_pool *pool, size_t size);
+void chkd_pool_destroy(chkd_pool *pool);
+
+//Tracked bump-pointer arena, each chunk is a block of the creation site and shows up in reports
+//Resetting releases every block but keeps the chunks, one thread at a time like pools
+typedef struct chkd_arena chkd_arena;
+#define CHKD_ARENA_CREATE(name) chkd_arena_create(name, __FILE__, __LINE__)
+chkd_arena *chkd_arena_create(char *name, char *file_name, int line);
+//16-byte aligned, NULL if no chunk could be allocated
+void *chkd_arena_alloc(chkd_arena *arena, size_t size);
+void chkd_arena_reset(chkd_arena *arena);
+void chkd_arena_destroy(chkd_arena *arena);
+
+#if ALLOC_CHECK_LEVEL > ALLOC_CHECK_LEVEL_OFF
 
 void report_alloc_checks();
 void cleanup_alloc_checks();
 
+//Allocations of at least 'size' bytes are reported as large (mmap backed), returns 0 on success
+int set_alloc_check_large_threshold(size_t size);
+//Order of missing frees and callsite lists in reports, one of ALLOC_CHECK_ORDER_*, returns 0 on success
+int set_alloc_check_report_order(int order);
+//Reports only list blocks and callsites matching every filter given: a file name glob ('*' and '?'),
+//lines 'first_line' to 'last_line' (0 for any), blocks of at least 'min_size' bytes and the CHKD_NEW
+//type name 'tag', NULL and 0 leave a filter unset, returns 0 on success
+int set_alloc_check_report_filter(char *file_glob, int first_line, int last_line, size_t min_size, char *tag);
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//Move histories of freed blocks to an append-only file, returns 0 on success
+int enable_alloc_check_history_spill(char *path);
+//Print the whole history of a block, reading it back from disk if spilled
+void report_alloc_check_block(size_t id);
+#endif
+
+//Mirror tracker state into a file mapping that survives crashes, keeping the last 'capacity' events
+//and up to 'capacity' live blocks, returns 0 on success
+int enable_alloc_check_mmap(char *path, size_t capacity);
+//Report the heap state stored in a file written by enable_alloc_check_mmap
+void report_alloc_check_mmap(char *path);
+
+//Publish live counters into a POSIX shared memory segment, watched with alloc_check_top
+//'name' defaults to /alloc_check.<pid> when NULL, returns 0 on success
+int enable_alloc_check_shm(char *name);
+
+//Keep the last FLIGHT_RECORDER_SIZE events in a fixed-size ring
+void enable_alloc_check_flight_recorder();
+//Also dump the ring to stderr on SIGSEGV, SIGABRT and SIGBUS, on an alternate stack set up for each
+//thread at its first tracked operation
+void install_alloc_check_signal_handlers();
+//Async-signal-safe, may be called from user signal handlers
+void dump_alloc_check_flight_recorder(int fd);
+//Keep only 1 in 'every' events in the ring (1 keeps all), returns 0 on success
+int set_alloc_check_trace_sampling(size_t every);
+
+//Zero every counter, blocks still live and their histories are kept
+void reset_alloc_check_counters();
+
+//Serve commands on a Unix domain socket from a background thread, needs ALLOC_CHECK_THREAD_SAFE
+//'path' defaults to /tmp/alloc_check.<pid>.sock when NULL, returns 0 on success
+//One command per connection, e.g. echo report | socat - UNIX-CONNECT:/tmp/alloc_check.<pid>.sock
+//report, block <id>, snapshot, reset, sample <every>, trace, help
+int enable_alloc_check_control(char *path);
+
+//Rewrite 'path' every 'interval_ms' (10s when 0) with totals, per-type and top callsite counters in the
+//Prometheus text format for the node exporter textfile collector, needs ALLOC_CHECK_THREAD_SAFE, returns 0 on success
+int enable_alloc_check_metrics(char *path, unsigned interval_ms);
+
+//Move recording off the calling threads, checked_* only queue a fixed-size event that a background
+//thread replays, reports replay what is pending first, needs ALLOC_CHECK_THREAD_SAFE, returns 0 on success
+int enable_alloc_check_async();
+
+#else
+
+//Nothing is tracked, calls compile down to nothing
+static inline void report_alloc_checks() { }
+static inline void cleanup_alloc_checks() { }
+static inline int set_alloc_check_large_threshold(size_t size) { (void)size; return -1; }
+static inline int set_alloc_check_report_order(int order) { (void)order; return -1; }
+static inline int set_alloc_check_report_filter(char *file_glob, int first_line, int last_line, size_t min_size, char *tag)
+{
+	(void)file_glob;
+	(void)first_line;
+	(void)last_line;
+	(void)min_size;
+	(void)tag;
+	return -1;
+}
+static inline int enable_alloc_check_mmap(char *path, size_t capacity) { (void)path; (void)capacity; return -1; }
+static inline void report_alloc_check_mmap(char *path) { (void)path; }
+static inline int enable_alloc_check_shm(char *name) { (void)name; return -1; }
+static inline void enable_alloc_check_flight_recorder() { }
+static inline void install_alloc_check_signal_handlers() { }
+static inline void dump_alloc_check_flight_recorder(int fd) { (void)fd; }
+static inline int set_alloc_check_trace_sampling(size_t every) { (void)every; return -1; }
+static inline void reset_alloc_check_counters() { }
+static inline int enable_alloc_check_control(char *path) { (void)path; return -1; }
+static inline int enable_alloc_check_metrics(char *path, unsigned interval_ms) { (void)path; (void)interval_ms; return -1; }
+static inline int enable_alloc_check_async() { return -1; }
+
+#endif
 
 #endif
@@ -0,0 +1,112 @@
+/**
+ * @file alloc_check_shm.h
+ *
+ * @brief Layout of the live statistics segment written by enable_alloc_check_shm
+ *
+ * @author Diogo Cruz Diniz
+ * Contact: diogo.cruz.diniz@tecnico.ulisboa.pt
+ */
+
+/**
+ * Notes:
+ * The tracked process is the only writer, readers map the segment read-only and never
+ * signal or lock anything, so watching a process puts no load on it
+ * Consistency comes from a seqlock, seq is odd while an update is being written
+ */
+
+#ifndef ALLOC_CHECK_SHM_H
+#define ALLOC_CHECK_SHM_H
+
+
+#include <stdint.h>
+
+
+#define ALLOC_CHECK_SHM_MAGIC "ACHKSHM"
+#define ALLOC_CHECK_SHM_VERSION 2
+#define ALLOC_CHECK_SHM_TOP 16
+#define ALLOC_CHECK_SHM_FILE_NAME_LEN 40
+#define ALLOC_CHECK_SHM_TYPES 16
+#define ALLOC_CHECK_SHM_TYPE_NAME_LEN 40
+
+enum ALLOC_CHECK_SHM_STATE
+{
+	ALLOC_CHECK_SHM_RUNNING = 1,
+	ALLOC_CHECK_SHM_CLEAN = 2,
+};
+
+typedef struct
+{
+	char file_name[ALLOC_CHECK_SHM_FILE_NAME_LEN]; //Or the return address in hex
+	int32_t line;
+	uint32_t pad;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+	uint64_t live_blocks;
+	uint64_t live_bytes;
+} alloc_check_shm_site;
+
+typedef struct
+{
+	char name[ALLOC_CHECK_SHM_TYPE_NAME_LEN]; //CHKD_NEW type, cut to fit
+	uint64_t size;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+	uint64_t live_blocks;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+} alloc_check_shm_type;
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint64_t pid;
+	uint64_t level; //ALLOC_CHECK_LEVEL, live counters are 0 below summary
+	volatile uint64_t state;
+	volatile uint64_t seq;
+
+	uint64_t alloc_count;
+	uint64_t realloc_count;
+	uint64_t free_count;
+	uint64_t alloc_bytes;
+	uint64_t live_blocks;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+
+	//Refreshed every few operations, by live bytes (allocated bytes below summary)
+	uint64_t site_count;
+	uint64_t top_count;
+	alloc_check_shm_site top[ALLOC_CHECK_SHM_TOP];
+
+	//Refreshed with the callsites, CHKD_NEW types by the same measure
+	uint64_t type_count;
+	uint64_t top_type_count;
+	alloc_check_shm_type types[ALLOC_CHECK_SHM_TYPES];
+} alloc_check_shm;
+
+
+#ifndef ALLOC_CHECK_SHM_RETRIES
+#define ALLOC_CHECK_SHM_RETRIES 100000 //An update takes a few hundred instructions
+#endif
+
+//Copies a consistent view of a mapped segment into 'out', retrying while it is being written
+//Returns 0 on success, -1 if no consistent view was seen, which is what a writer that died
+//mid-update leaves behind for good, the caller can tell by probing the pid
+static inline int read_alloc_check_shm(const alloc_check_shm *shm, alloc_check_shm *out)
+{
+	for (int i = 0; i < ALLOC_CHECK_SHM_RETRIES; i++)
+	{
+		uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+
+		__builtin_memcpy(out, (const void *)shm, sizeof(alloc_check_shm));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) return 0;
+	}
+
+	return -1;
+}
+
+#endif
@@ -9,19 +9,600 @@
 
 
 
+//dladdr, used to name return addresses
+#define _GNU_SOURCE
 //Allow the use of standard alloc, realloc and free
 #define ALLOW_STANDARD_MEM
 #include "alloc_check.h"
+#include "alloc_check_shm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dlfcn.h>
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+#include <execinfo.h>
+#endif
+
+
+
+//===Bump chunks===
+//Chunks carved front to back, shared by pools and arenas at every level
+#ifndef ALLOC_CHECK_CHUNK_SIZE
+#define ALLOC_CHECK_CHUNK_SIZE 0x10000
+#endif
+#define POOL_NAME_LEN 32
+
+typedef struct bump_chunk
+{
+	struct bump_chunk *next; //Next in the owner's list
+	size_t size; //Usable bytes in data
+	size_t used;
+	size_t generation; //Arena chunks, tracker_generation when allocated
+	_Alignas(16) char data[];
+} bump_chunk;
+
+//Arena chunks are recorded like checked_malloc and checked_free, the free only in the generation
+//the chunk was recorded in
+static void *checked_chunk_malloc(size_t size, char *file_name, int line, size_t *generation);
+static void checked_chunk_free(void *ptr, size_t generation, char *file_name, int line);
+
+//Larger sizes would wrap once rounded up and given a chunk header
+#define BUMP_MAX_SIZE (SIZE_MAX - sizeof(bump_chunk) - 15)
+
+//Returns NULL when the chunk has no room left, blocks are 16-byte aligned
+static void *bump_alloc(bump_chunk *chunk, size_t size)
+{
+	if (chunk == NULL || size > BUMP_MAX_SIZE) return NULL;
+
+	size = (size + 15) & ~(size_t)15;
+	if (chunk->size - chunk->used < size) return NULL;
+
+	void *ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+//Pool and arena counters have a single writer, the owning thread, reports only need untorn reads
+static void owner_add(size_t *counter, size_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+//Blocks are only released together
+struct chkd_pool
+{
+	char name[POOL_NAME_LEN];
+	char *file_name; //Where it was created
+	int line;
+
+	bump_chunk *chunks; //Newest first
+	size_t allocs;
+	size_t used_bytes;
+	size_t reserved_bytes; //Held in chunks, handed out or not
+	size_t failed_allocs; //Oversized or out of memory
+
+	char registered; //Listed in status.pools, guarded by status_lock like the links
+	struct chkd_pool *prev, *next;
+};
+
+void *chkd_pool_alloc(chkd_pool *pool, size_t size)
+{
+	if (size > BUMP_MAX_SIZE)
+	{
+		owner_add(&pool->failed_allocs, 1);
+		return NULL;
+	}
+
+	void *ptr = bump_alloc(pool->chunks, size);
+
+	if (ptr == NULL)
+	{
+		size_t chunk_size = size > ALLOC_CHECK_CHUNK_SIZE ? (size + 15) & ~(size_t)15 : ALLOC_CHECK_CHUNK_SIZE;
+		bump_chunk *chunk = malloc(sizeof(bump_chunk) + chunk_size);
+		if (chunk == NULL)
+		{
+			owner_add(&pool->failed_allocs, 1);
+			return NULL;
+		}
+
+		chunk->next = pool->chunks;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		pool->chunks = chunk;
+		owner_add(&pool->reserved_bytes, chunk_size);
+
+		ptr = bump_alloc(chunk, size);
+	}
+
+	owner_add(&pool->allocs, 1);
+	owner_add(&pool->used_bytes, size);
+	return ptr;
+}
+
+static void release_pool_chunks(chkd_pool *pool)
+{
+	while (pool->chunks != NULL)
+	{
+		bump_chunk *next = pool->chunks->next;
+		free(pool->chunks);
+		pool->chunks = next;
+	}
+}
+
+//Chunks are tracked blocks of the creation site, kept across resets and reused in order
+struct chkd_arena
+{
+	char name[POOL_NAME_LEN];
+	char *file_name; //Where it was created
+	int line;
+
+	bump_chunk *chunks; //Oldest first
+	bump_chunk *current;
+	size_t allocs;
+	size_t used_bytes; //Requested since the last reset
+	size_t wasted_bytes; //Alignment padding and chunk tails skipped since the last reset
+	size_t peak_bytes; //Most bytes used between two resets
+	size_t reserved_bytes;
+	size_t resets;
+	size_t failed_allocs; //Oversized or out of memory
+
+	char registered; //Listed in status.arenas, guarded by status_lock like the links
+	struct chkd_arena *prev, *next;
+};
+
+void *chkd_arena_alloc(chkd_arena *arena, size_t size)
+{
+	if (size > BUMP_MAX_SIZE)
+	{
+		owner_add(&arena->failed_allocs, 1);
+		return NULL;
+	}
+
+	void *ptr = bump_alloc(arena->current, size);
+
+	//Whatever is left in a chunk that is moved past is wasted until the next reset
+	while (ptr == NULL && arena->current != NULL && arena->current->next != NULL)
+	{
+		owner_add(&arena->wasted_bytes, arena->current->size - arena->current->used);
+		arena->current = arena->current->next;
+		ptr = bump_alloc(arena->current, size);
+	}
+
+	if (ptr == NULL)
+	{
+		size_t chunk_size = size > ALLOC_CHECK_CHUNK_SIZE ? (size + 15) & ~(size_t)15 : ALLOC_CHECK_CHUNK_SIZE;
+		size_t generation;
+		bump_chunk *chunk = checked_chunk_malloc(sizeof(bump_chunk) + chunk_size, arena->file_name, arena->line, &generation);
+		if (chunk == NULL)
+		{
+			owner_add(&arena->failed_allocs, 1);
+			return NULL;
+		}
+
+		chunk->generation = generation;
+		chunk->next = NULL;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+
+		if (arena->current != NULL)
+		{
+			owner_add(&arena->wasted_bytes, arena->current->size - arena->current->used);
+			arena->current->next = chunk;
+		}
+		else
+			arena->chunks = chunk;
+		arena->current = chunk;
+		owner_add(&arena->reserved_bytes, chunk_size);
+
+		ptr = bump_alloc(chunk, size);
+	}
+
+	owner_add(&arena->allocs, 1);
+	owner_add(&arena->used_bytes, size);
+	owner_add(&arena->wasted_bytes, ((size + 15) & ~(size_t)15) - size);
+	if (arena->used_bytes > arena->peak_bytes) __atomic_store_n(&arena->peak_bytes, arena->used_bytes, __ATOMIC_RELAXED);
+	return ptr;
+}
+
+//Every block handed out is released, the chunks are kept for reuse
+void chkd_arena_reset(chkd_arena *arena)
+{
+	for (bump_chunk *chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+		chunk->used = 0;
+
+	arena->current = arena->chunks;
+	__atomic_store_n(&arena->used_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&arena->wasted_bytes, 0, __ATOMIC_RELAXED);
+	owner_add(&arena->resets, 1);
+}
+
+static void release_arena_chunks(chkd_arena *arena)
+{
+	while (arena->chunks != NULL)
+	{
+		bump_chunk *next = arena->chunks->next;
+		checked_chunk_free(arena->chunks, arena->chunks->generation, arena->file_name, arena->line);
+		arena->chunks = next;
+	}
+
+	arena->current = NULL;
+}
+
+
+
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF
+//Nothing is tracked, only kept for callers that use checked_* directly
+void *checked_malloc(size_t size, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	return malloc(size);
+}
+
+void *checked_calloc(size_t nitems, size_t size, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	return calloc(nitems, size);
+}
+
+void *checked_realloc(void *ptr, size_t size, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	return realloc(ptr, size);
+}
+
+void checked_free(void *ptr, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	free(ptr);
+}
+
+size_t checked_malloc_batch(size_t count, size_t size, void **out, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	size_t allocated = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = malloc(size);
+		if (out[i] != NULL) allocated++;
+	}
+
+	return allocated;
+}
+
+void checked_free_batch(void **ptrs, size_t count, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+
+	for (size_t i = 0; i < count; i++)
+		free(ptrs[i]);
+}
+
+void *checked_new(chkd_type *type, size_t count, char *file_name, int line)
+{
+	(void)file_name;
+	(void)line;
+	return calloc(count, type->size);
+}
+
+static void *checked_chunk_malloc(size_t size, char *file_name, int line, size_t *generation)
+{
+	(void)file_name;
+	(void)line;
+	*generation = 0;
+	return malloc(size);
+}
+
+static void checked_chunk_free(void *ptr, size_t generation, char *file_name, int line)
+{
+	(void)generation;
+	(void)file_name;
+	(void)line;
+	free(ptr);
+}
+
+chkd_pool *chkd_pool_create(char *name, char *file_name, int line)
+{
+	chkd_pool *pool = calloc(1, sizeof(chkd_pool));
+	if (pool == NULL) return NULL;
+
+	snprintf(pool->name, POOL_NAME_LEN, "%s", name != NULL ? name : "unnamed");
+	pool->file_name = file_name;
+	pool->line = line;
+	return pool;
+}
+
+void chkd_pool_destroy(chkd_pool *pool)
+{
+	if (pool == NULL) return;
+
+	release_pool_chunks(pool);
+	free(pool);
+}
+
+chkd_arena *chkd_arena_create(char *name, char *file_name, int line)
+{
+	chkd_arena *arena = calloc(1, sizeof(chkd_arena));
+	if (arena == NULL) return NULL;
+
+	snprintf(arena->name, POOL_NAME_LEN, "%s", name != NULL ? name : "unnamed");
+	arena->file_name = file_name;
+	arena->line = line;
+	return arena;
+}
+
+void chkd_arena_destroy(chkd_arena *arena)
+{
+	if (arena == NULL) return;
 
+	release_arena_chunks(arena);
+	free(arena);
+}
+#else
 
 
 #define DIE do { fprintf(stderr, "alloc_check encountered a fatal error.\n"); exit(72); } while (0)
 #define DIE_NULL(ptr) do { if (ptr == NULL) DIE; } while (0)
 
+//Tracker state is guarded by one lock, reports only hold it while taking a snapshot
+#ifndef ALLOC_CHECK_THREAD_SAFE
+#define ALLOC_CHECK_THREAD_SAFE 1
+#endif
+
+#if ALLOC_CHECK_THREAD_SAFE
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK(lock) pthread_mutex_lock(&lock)
+#define UNLOCK(lock) pthread_mutex_unlock(&lock)
+#else
+#define LOCK(lock) do { } while (0)
+#define UNLOCK(lock) do { } while (0)
+#endif
+
+//Bumped by cleanup_alloc_checks, blocks recorded in an earlier generation are no longer tracked
+static size_t tracker_generation = 0;
+
+
+
+//===Metadata pool===
+//Reserved up front, so tracking keeps working when malloc starts failing
+#ifndef META_POOL_SIZE
+#define META_POOL_SIZE 0x400000
+#endif
+#define META_POOL_CLASSES 48
+#define META_POOL_MIN_CLASS 4 //16 bytes
+
+typedef struct
+{
+	size_t size_class;
+	size_t pad; //Keeps user data 16-byte aligned
+} meta_header;
+
+static struct
+{
+	_Alignas(16) char data[META_POOL_SIZE];
+	size_t used;
+	size_t peak_live;
+	size_t live;
+	meta_header *free_lists[META_POOL_CLASSES];
+} meta_pool;
+
+static int in_meta_pool(void *ptr)
+{
+	return (char *)ptr >= meta_pool.data && (char *)ptr < meta_pool.data + META_POOL_SIZE;
+}
+
+//NULL past the largest class, callers die on it like on any failed metadata allocation
+static void *meta_pool_malloc(size_t size)
+{
+	if (size > (size_t)1 << (META_POOL_CLASSES - 1)) return NULL;
+
+	size_t size_class = META_POOL_MIN_CLASS;
+	while (((size_t)1 << size_class) < size) size_class++;
+
+	meta_header *header = meta_pool.free_lists[size_class];
+	if (header != NULL)
+	{
+		//Free blocks keep the next pointer in their data
+		meta_pool.free_lists[size_class] = *(meta_header **)(header + 1);
+	}
+	else
+	{
+		size_t needed = sizeof(meta_header) + ((size_t)1 << size_class);
+		if (META_POOL_SIZE - meta_pool.used < needed) DIE;
+
+		header = (meta_header *)(meta_pool.data + meta_pool.used);
+		header->size_class = size_class;
+		meta_pool.used += needed;
+	}
+
+	meta_pool.live += (size_t)1 << size_class;
+	if (meta_pool.live > meta_pool.peak_live) meta_pool.peak_live = meta_pool.live;
+
+	return header + 1;
+}
+
+//Batches carve their metadata out of one allocation split in equal cells, each piece of a cell is
+//freed on its own like any metadata and the slab goes back to malloc with the last one
+typedef struct
+{
+	size_t length;
+	size_t cell;
+	size_t refs; //Pieces not freed yet
+	size_t pad; //Keeps cells 16-byte aligned
+} meta_slab;
+
+static struct
+{
+	meta_slab **data; //By address
+	size_t count;
+	size_t capacity;
+} meta_slabs = { .data = NULL, .count = 0, .capacity = 0 };
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//NULL if malloc fails, the caller allocates piece by piece then
+static char *meta_slab_alloc(size_t cell, size_t count, size_t pieces)
+{
+	if (meta_slabs.count == meta_slabs.capacity)
+	{
+		size_t capacity = meta_slabs.capacity ? meta_slabs.capacity << 1 : 16;
+		meta_slab **tmp = realloc(meta_slabs.data, capacity * sizeof(meta_slab *));
+		if (tmp == NULL) return NULL;
+
+		meta_slabs.data = tmp;
+		meta_slabs.capacity = capacity;
+	}
+
+	meta_slab *slab = malloc(sizeof(meta_slab) + cell * count);
+	if (slab == NULL) return NULL;
+	slab->length = cell * count;
+	slab->cell = cell;
+	slab->refs = pieces * count;
+
+	size_t i = meta_slabs.count++;
+	for (; i > 0 && meta_slabs.data[i - 1] > slab; i--)
+		meta_slabs.data[i] = meta_slabs.data[i - 1];
+	meta_slabs.data[i] = slab;
+
+	return (char *)(slab + 1);
+}
+#endif
+
+static meta_slab *find_meta_slab(void *ptr)
+{
+	size_t low = 0, high = meta_slabs.count;
+
+	//Last slab starting below 'ptr'
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if ((void *)meta_slabs.data[mid] < ptr) low = mid + 1;
+		else high = mid;
+	}
+	if (low == 0) return NULL;
+
+	meta_slab *slab = meta_slabs.data[low - 1];
+	return (char *)ptr < (char *)(slab + 1) + slab->length ? slab : NULL;
+}
+
+static void release_meta_slab(meta_slab *slab)
+{
+	if (--slab->refs != 0) return;
+
+	size_t i = 0;
+	while (meta_slabs.data[i] != slab) i++;
+	memmove(meta_slabs.data + i, meta_slabs.data + i + 1, (meta_slabs.count - i - 1) * sizeof(meta_slab *));
+	meta_slabs.count--;
+	free(slab);
+
+	if (meta_slabs.count == 0)
+	{
+		free(meta_slabs.data);
+		meta_slabs.data = NULL;
+		meta_slabs.capacity = 0;
+	}
+}
+
+static void meta_free(void *ptr)
+{
+	if (ptr == NULL) return;
+
+	meta_slab *slab = meta_slabs.count != 0 ? find_meta_slab(ptr) : NULL;
+	if (slab != NULL)
+	{
+		release_meta_slab(slab);
+		return;
+	}
+
+	if (!in_meta_pool(ptr))
+	{
+		free(ptr);
+		return;
+	}
+
+	meta_header *header = (meta_header *)ptr - 1;
+	*(meta_header **)ptr = meta_pool.free_lists[header->size_class];
+	meta_pool.free_lists[header->size_class] = header;
+	meta_pool.live -= (size_t)1 << header->size_class;
+}
+
+static void *meta_malloc(size_t size)
+{
+	void *ptr = malloc(size);
+	if (ptr != NULL) return ptr;
+
+	return meta_pool_malloc(size);
+}
+
+static void *meta_calloc(size_t nitems, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nitems, size, &total)) return NULL;
+
+	void *ptr = calloc(nitems, size);
+	if (ptr != NULL) return ptr;
+
+	ptr = meta_pool_malloc(total);
+	if (ptr != NULL) memset(ptr, 0, total);
+	return ptr;
+}
+
+static void *meta_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL) return meta_malloc(size);
+
+	size_t old_size;
+	meta_slab *slab = meta_slabs.count != 0 ? find_meta_slab(ptr) : NULL;
+
+	if (slab != NULL)
+	{
+		//Only the last piece of a cell grows, it can use up to the end of the cell
+		size_t offset = (char *)ptr - (char *)(slab + 1);
+		old_size = slab->cell - offset % slab->cell;
+		if (old_size >= size) return ptr;
+	}
+	else if (in_meta_pool(ptr))
+	{
+		old_size = (size_t)1 << ((meta_header *)ptr - 1)->size_class;
+		if (old_size >= size) return ptr;
+	}
+	else
+	{
+		void *tmp = realloc(ptr, size);
+		if (tmp != NULL) return tmp;
+		old_size = malloc_usable_size(ptr);
+	}
+
+	void *tmp = meta_malloc(size);
+	if (tmp == NULL) return NULL;
+	memcpy(tmp, ptr, old_size < size ? old_size : size);
+	meta_free(ptr);
+	return tmp;
+}
+
 
 
 enum TERM_COLOR
@@ -45,9 +626,71 @@ enum TERM_COLOR
 	COLOR_WHITE = 97,
 };
 
+//===Report emitter===
+//Reports are streamed through a fixed buffer straight to a file descriptor,
+//so they never allocate (stdio may) and work while out of memory
+#define EMIT_BUFF_SIZE 4096
+#define EMIT_LINE_SIZE 512
+
+static struct
+{
+	int fd;
+	char color; //Off for pipes and sockets read by scripts
+	size_t len;
+	char buff[EMIT_BUFF_SIZE];
+} emitter = { .fd = STDOUT_FILENO, .color = 1, .len = 0 };
+
+static void emit_flush()
+{
+	size_t done = 0;
+
+	while (done < emitter.len)
+	{
+		ssize_t written = write(emitter.fd, emitter.buff + done, emitter.len - done);
+		if (written <= 0) break; //Nowhere to report the error to
+		done += written;
+	}
+
+	emitter.len = 0;
+}
+
+static void emit(const char *format, ...)
+{
+	char line[EMIT_LINE_SIZE];
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, EMIT_LINE_SIZE, format, args);
+	va_end(args);
+
+	if (len < 0) return;
+	if (len >= EMIT_LINE_SIZE) len = EMIT_LINE_SIZE - 1;
+
+	if (emitter.len + len > EMIT_BUFF_SIZE) emit_flush();
+	memcpy(emitter.buff + emitter.len, line, len);
+	emitter.len += len;
+}
+
+static void emit_begin(int fd, char color)
+{
+	//Keep ordering with anything the program already printed
+	if (fd == STDOUT_FILENO) fflush(stdout);
+	emitter.fd = fd;
+	emitter.color = color;
+	emitter.len = 0;
+}
+
+static void emit_end()
+{
+	emit_flush();
+	emitter.fd = STDOUT_FILENO;
+	emitter.color = 1;
+}
+
 static void set_color(int fg, int bg, char bold)
 {
-	printf("\033[%d;%dm\033[%dm", bold, fg, bg + 10);
+	if (!emitter.color) return;
+	emit("\033[%d;%dm\033[%dm", bold, fg, bg + 10);
 }
 
 
@@ -106,6 +749,30 @@ static char *format_file_line(char *file_name, int line)
 
 	return __format_file_line_buff;
 }
+static char __format_address_buff[45+1];
+static char *format_address(void *address, int width)
+{
+	//dladdr only sees exported symbols, others are shown as an offset into their object (for addr2line)
+	Dl_info info;
+	if (dladdr(address, &info) == 0)
+	{
+		snprintf(__format_address_buff, width + 1, "%p", address);
+		return __format_address_buff;
+	}
+
+	const char *name = info.dli_sname;
+	char *base = info.dli_saddr;
+	if (name == NULL)
+	{
+		name = strrchr(info.dli_fname, '/') != NULL ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+		base = info.dli_fbase;
+	}
+
+	char offset[24];
+	int offset_len = snprintf(offset, sizeof(offset), "+0x%lx", (long)((char *)address - base));
+	snprintf(__format_address_buff, width + 1, "%.*s%s", width > offset_len ? width - offset_len : 0, name, offset);
+	return __format_address_buff;
+}
 #pragma GCC diagnostic pop
 
 
@@ -122,10 +789,10 @@ typedef struct
 
 static voidptr_array *create_voidptr_array()
 {
-	voidptr_array *ret = malloc(sizeof(voidptr_array));
+	voidptr_array *ret = meta_malloc(sizeof(voidptr_array));
 	DIE_NULL(ret);
 
-	ret->data = malloc(VOIDPTRARR_DEFAULT_CAP * sizeof(void *));
+	ret->data = meta_malloc(VOIDPTRARR_DEFAULT_CAP * sizeof(void *));
 	DIE_NULL(ret->data);
 	ret->count = 0;
 	ret->capacity = VOIDPTRARR_DEFAULT_CAP;
@@ -135,8 +802,8 @@ static voidptr_array *create_voidptr_array()
 
 static void destroy_voidptr_array(voidptr_array *arr)
 {
-	free(arr->data);
-	free(arr);
+	meta_free(arr->data);
+	meta_free(arr);
 }
 
 static void ensure_voidptr_array(voidptr_array *arr, size_t capacity)
@@ -146,22 +813,24 @@ static void ensure_voidptr_array(voidptr_array *arr, size_t capacity)
 	if (arr->capacity < VOIDPTRARR_DEFAULT_CAP) arr->capacity = VOIDPTRARR_DEFAULT_CAP;
 	while (arr->capacity < capacity) arr->capacity <<= 1;
 
-	void **tmp = realloc(arr->data, arr->capacity * sizeof(void *));
+	void **tmp = meta_realloc(arr->data, arr->capacity * sizeof(void *));
 	DIE_NULL(tmp);
 
 	arr->data = tmp;
 }
 
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
 static void trim_voidptr_array(voidptr_array *arr)
 {
 	if (arr->count == arr->capacity) return;
 
-	void **tmp = realloc(arr->data, arr->count * sizeof(void *));
+	void **tmp = meta_realloc(arr->data, arr->count * sizeof(void *));
 	DIE_NULL(tmp);
 
 	arr->data = tmp;
 	arr->capacity = arr->count;
 }
+#endif
 
 static void append_voidptr_array(voidptr_array *arr, void *data)
 {
@@ -169,6 +838,13 @@ static void append_voidptr_array(voidptr_array *arr, void *data)
 	arr->data[arr->count++] = data;
 }
 
+static size_t hash_pointer(void *ptr)
+{
+	uint64_t hash = (uintptr_t)ptr >> 4;
+	hash *= 0x9E3779B97F4A7C15ull;
+	return hash >> 20;
+}
+
 
 
 enum ENTRY_TYPE
@@ -180,90 +856,646 @@ enum ENTRY_TYPE
 	ENTRY_FREE = 4,
 };
 
-typedef struct
+//===Types===
+//Totals per CHKD_NEW type, interned on first use, callsites point at the type they allocate
+#define TYPE_LENGTH_BUCKETS 7 //Array lengths 1, 2-3, 4-15, 16-63, 64-255, 256-1023, 1024 or more
+
+typedef struct type_stats
 {
-	size_t id;
+	const char *name; //The descriptor's string literal
+	size_t size;
+
+	size_t allocs;
+	size_t objects;
+	size_t alloc_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t live_blocks;
+	size_t live_bytes;
+	size_t peak_bytes;
+#endif
+	size_t lengths[TYPE_LENGTH_BUCKETS];
+
+	struct type_stats *next;
+	struct type_stats *copy; //Only valid while a snapshot is being taken
+} type_stats;
+
+static int length_bucket(size_t count)
+{
+	if (count < 2) return 0;
+
+	int bucket = 1;
+	for (size_t limit = 4; count >= limit && bucket < TYPE_LENGTH_BUCKETS - 1; limit <<= 2)
+		bucket++;
+
+	return bucket;
+}
+
+//===Callsites===
+//Interned file:line pairs, with per-callsite counters
+#define CALLSITE_TABLE_DEFAULT_CAP 64
+
+#ifndef ALLOC_CHECK_CACHE_LINE
+#define ALLOC_CHECK_CACHE_LINE 64
+#endif
+#ifndef ALLOC_CHECK_SIMD_WIDTH
+#define ALLOC_CHECK_SIMD_WIDTH 32 //AVX2
+#endif
+
+//Returned pointer alignment buckets, 16 or less, 32, 64, 128 or more
+#define ALIGN_BUCKETS 4
+#define ALIGN_MIN_SHIFT 4
+
+typedef struct callsite_stats
+{
+	char *key; //Caller's file name pointer (or return address), used for lookups
+	char *file_name; //Owned copy, used for reporting, NULL for return addresses
+	int line;
+	type_stats *type; //Set by the first CHKD_NEW here, its blocks are also counted there
+	struct callsite_stats *copy; //Only valid while a report is being written
+	size_t rank; //Position in the report order, only set in snapshots
+
+	//Blocks allocated here
+	size_t allocs;
+	size_t alloc_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t live_blocks;
+	size_t live_bytes;
+#endif
+
+	//Above large_threshold, each one is likely an mmap/munmap pair
+	size_t large_allocs;
+	size_t large_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t large_frees;
+#endif
+
+	size_t alignments[ALIGN_BUCKETS];
+	size_t line_splits; //Blocks that fit a cache line but straddle two
+	size_t simd_misaligned; //Blocks of at least ALLOC_CHECK_SIMD_WIDTH not aligned to it
+
+	//Operations done here
+	size_t frees;
+	size_t failed_reallocs;
+	size_t reallocs_in_place;
+	size_t reallocs_moved;
+	size_t realloc_copied_bytes; //Estimated, smaller of old and new size per move
+
+	//Operations that produced no block (id 0)
+	size_t failed_allocs;
+	size_t zero_allocs;
+	size_t null_reallocs;
+	size_t null_frees;
+	size_t invalid_frees; //Double frees or pointers never allocated
+} callsite_stats;
+
+typedef struct
+{
+	callsite_stats **data;
+	size_t capacity;
+	size_t count;
+} callsite_table;
+
+static size_t hash_callsite(char *key, int line)
+{
+	uint64_t hash = ((uintptr_t)key >> 3) ^ ((uint64_t)line << 32);
+	hash *= 0x9E3779B97F4A7C15ull;
+	return hash >> 17;
+}
+
+static void init_callsite_table(callsite_table *table)
+{
+	table->data = meta_calloc(CALLSITE_TABLE_DEFAULT_CAP, sizeof(callsite_stats *));
+	DIE_NULL(table->data);
+	table->capacity = CALLSITE_TABLE_DEFAULT_CAP;
+	table->count = 0;
+}
+
+static void destroy_callsite_table(callsite_table *table)
+{
+	for (size_t i = 0; i < table->capacity; i++)
+	{
+		if (table->data[i] == NULL) continue;
+		meta_free(table->data[i]->file_name);
+		meta_free(table->data[i]);
+	}
+
+	meta_free(table->data);
+	table->data = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}
+
+static void grow_callsite_table(callsite_table *table)
+{
+	size_t capacity = table->capacity << 1;
+	callsite_stats **data = meta_calloc(capacity, sizeof(callsite_stats *));
+	DIE_NULL(data);
+
+	for (size_t i = 0; i < table->capacity; i++)
+	{
+		callsite_stats *site = table->data[i];
+		if (site == NULL) continue;
+
+		size_t slot = hash_callsite(site->key, site->line) & (capacity - 1);
+		while (data[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+		data[slot] = site;
+	}
+
+	meta_free(table->data);
+	table->data = data;
+	table->capacity = capacity;
+}
+
+static callsite_stats *get_callsite(callsite_table *table, char *file_name, int line)
+{
+	size_t slot = hash_callsite(file_name, line) & (table->capacity - 1);
+
+	while (table->data[slot] != NULL)
+	{
+		callsite_stats *site = table->data[slot];
+		if (site->key == file_name && site->line == line)
+			return site;
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	callsite_stats *site = meta_calloc(1, sizeof(callsite_stats));
+	DIE_NULL(site);
+	if (line != CHKD_RETURN_ADDRESS_LINE)
+	{
+		site->file_name = meta_malloc(strlen(file_name) + 1);
+		DIE_NULL(site->file_name);
+		strcpy(site->file_name, file_name);
+	}
+	site->key = file_name;
+	site->line = line;
+
+	table->data[slot] = site;
+	table->count++;
+
+	//Keep load under 50%
+	if (table->count * 2 > table->capacity)
+		grow_callsite_table(table);
+
+	return site;
+}
+
+//Return addresses are only resolved here, when reported
+static char *format_callsite(callsite_stats *site)
+{
+	if (site->line == CHKD_RETURN_ADDRESS_LINE)
+		return format_address(site->key, 25);
+
+	return format_file_line(site->file_name, site->line);
+}
+
+
+
+#if ALLOC_CHECK_THREAD_SAFE
+//===Threads===
+//Threads get a slot on their first tracked operation, any past the limit share the last one
+#ifndef ALLOC_CHECK_MAX_THREADS
+#define ALLOC_CHECK_MAX_THREADS 64
+#endif
+
+typedef struct
+{
+	pid_t tid; //First thread to use the slot
+	size_t allocs;
+	size_t alloc_bytes;
+	size_t frees;
+	size_t cross_frees; //Blocks freed here that another thread allocated
+} thread_stats;
+
+static __thread int thread_index = -1;
+#endif
+
+
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+//===Live index===
+//Open addressing map of live pointers, the only per-block state kept at summary level
+#define LIVE_INDEX_DEFAULT_CAP 1024
+
+typedef struct
+{
+	void *ptr; //NULL marks an empty slot
+	size_t size;
+	size_t id;
+	callsite_stats *site;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	voidptr_array *entries; //History, also listed in entry_lookup
+#endif
+#if ALLOC_CHECK_THREAD_SAFE
+	int thread; //Allocating thread
+#endif
+} live_block;
+
+typedef struct
+{
+	live_block *data;
+	size_t capacity;
+	size_t count;
+} live_index;
+
+static void init_live_index(live_index *index)
+{
+	index->data = meta_calloc(LIVE_INDEX_DEFAULT_CAP, sizeof(live_block));
+	index->capacity = LIVE_INDEX_DEFAULT_CAP;
+	index->count = 0;
+}
+
+static void destroy_live_index(live_index *index)
+{
+	meta_free(index->data);
+	index->data = NULL;
+	index->capacity = 0;
+	index->count = 0;
+}
+
+static live_block *find_live_block(live_index *index, void *ptr)
+{
+	if (ptr == NULL) return NULL;
+
+	size_t mask = index->capacity - 1;
+	size_t slot = hash_pointer(ptr) & mask;
+
+	while (index->data[slot].ptr != NULL)
+	{
+		if (index->data[slot].ptr == ptr)
+			return &index->data[slot];
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static void resize_live_index(live_index *index, size_t capacity)
+{
+	live_block *data = meta_calloc(capacity, sizeof(live_block));
+
+	for (size_t i = 0; i < index->capacity; i++)
+	{
+		if (index->data[i].ptr == NULL) continue;
+
+		size_t slot = hash_pointer(index->data[i].ptr) & (capacity - 1);
+		while (data[slot].ptr != NULL) slot = (slot + 1) & (capacity - 1);
+		data[slot] = index->data[i];
+	}
+
+	meta_free(index->data);
+	index->data = data;
+	index->capacity = capacity;
+}
+
+//Room for 'count' more blocks, rehashing at most once
+static void reserve_live_index(live_index *index, size_t count)
+{
+	size_t capacity = index->capacity;
+	while ((index->count + count) * 2 > capacity) capacity <<= 1;
+
+	if (capacity != index->capacity) resize_live_index(index, capacity);
+}
+
+//Returned slot is only valid until the next insertion or removal
+static live_block *insert_live_block(live_index *index, void *ptr)
+{
+	//Keep load under 50%
+	if ((index->count + 1) * 2 > index->capacity)
+		resize_live_index(index, index->capacity << 1);
+
+	size_t mask = index->capacity - 1;
+	size_t slot = hash_pointer(ptr) & mask;
+
+	while (index->data[slot].ptr != NULL && index->data[slot].ptr != ptr)
+		slot = (slot + 1) & mask;
+
+	if (index->data[slot].ptr == NULL) index->count++;
+	index->data[slot].ptr = ptr;
+	return &index->data[slot];
+}
+
+static void remove_live_block(live_index *index, live_block *block)
+{
+	size_t mask = index->capacity - 1;
+	size_t hole = block - index->data;
+	size_t slot = hole;
+
+	//Backward shift deletion, no tombstones needed
+	while (1)
+	{
+		slot = (slot + 1) & mask;
+		if (index->data[slot].ptr == NULL) break;
+
+		size_t home = hash_pointer(index->data[slot].ptr) & mask;
+		if (((slot - home) & mask) >= ((slot - hole) & mask))
+		{
+			index->data[hole] = index->data[slot];
+			hole = slot;
+		}
+	}
+
+	index->data[hole].ptr = NULL;
+	index->count--;
+}
+#endif
+
+
+
+#ifndef ALLOC_CHECK_STACK_DEPTH
+#define ALLOC_CHECK_STACK_DEPTH 8
+#endif
+
+typedef struct
+{
+	size_t id;
 	int type;
 
 	void *old_ptr, *new_ptr;
 	size_t size;
-	char *file_name;
-	int line;
+	callsite_stats *site;
+#if ALLOC_CHECK_THREAD_SAFE
+	int thread;
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	void *stack[ALLOC_CHECK_STACK_DEPTH]; //Return addresses, NULL terminated if shorter
+#endif
 } memory_entry;
 
+//Operations with no block are kept as counters plus a capped reservoir sample
+#define NULL_SAMPLE_SIZE 32
+
+enum NULL_OP
+{
+	NULL_OP_ALLOC = 0,
+	NULL_OP_REALLOC = 1,
+	NULL_OP_FREE = 2,
+	NULL_OP_COUNT = 3,
+};
+
+//Narrows what reports list, set by set_alloc_check_report_filter
+#define FILTER_TEXT_LEN 256
+
 typedef struct
 {
-	size_t id_counter;
+	char active;
+	char file_glob[FILTER_TEXT_LEN]; //Empty matches any file
+	int first_line, last_line; //A last line of 0 matches any line
+	size_t min_size;
+	char tag[FILTER_TEXT_LEN]; //CHKD_NEW type name, empty matches untyped blocks too
+} report_filter;
 
-	//Each [m/c]alloc, realloc and free entries
-	voidptr_array *allocs;
-	voidptr_array *reallocs;
-	voidptr_array *frees;
+typedef struct
+{
+	//Each [m/c]alloc, realloc and free counts
+	size_t alloc_count;
+	size_t realloc_count;
+	size_t free_count;
+	size_t alloc_bytes;
 
-	//Index to pointer matching
-	voidptr_array *pointers;
-	//Entries per index (List<List<entry>>)
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t id_counter;
+	size_t live_bytes;
+	size_t peak_bytes;
+
+	//Pointer to live block matching
+	live_index live;
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	//Entries per block (List<List<entry>>) in id order, position 0 is left empty
 	voidptr_array *entry_lookup;
+	//Id at each entry_lookup position, spilled blocks leave NULL holes there until compacted
+	size_t *entry_ids;
+	size_t entry_holes;
+	//Freed histories the report shows (zero-sized or failed operations), they are never spilled
+	voidptr_array *kept;
+	//Entries in the histories of live blocks and of kept ones, what a snapshot copies at most
+	size_t live_entries;
+	size_t kept_entries;
+	//Spilled entries of freed histories a failed write dropped
+	size_t spill_lost;
+#endif
+
+	callsite_table callsites;
+
+	//Pools not destroyed yet, newest first
+	chkd_pool *pools;
+	size_t pool_count;
+	size_t pools_created;
+	size_t pools_destroyed;
+
+	//Arenas not destroyed yet, newest first
+	chkd_arena *arenas;
+	size_t arena_count;
+	size_t arenas_created;
+	size_t arenas_destroyed;
+
+	//Types allocated through CHKD_NEW, newest first
+	type_stats *types;
+	size_t type_count;
+
+	//Reservoir samples of id 0 entries, per NULL_OP
+	voidptr_array *null_samples[NULL_OP_COUNT];
+	size_t null_seen[NULL_OP_COUNT];
+	uint64_t sample_seed;
+
+#if ALLOC_CHECK_THREAD_SAFE
+	thread_stats threads[ALLOC_CHECK_MAX_THREADS];
+	int thread_count; //Slots are kept across cleanups, like the thread_index pointing to them
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY && ALLOC_CHECK_THREAD_SAFE
+	char live_sorted; //Only in snapshots, live holds a compact array sorted by address
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	//Only in snapshots, positions of the lost blocks (in entry_lookup, or live below full) in report order
+	size_t *lost_order;
+	size_t lost_count;
+#endif
+	report_filter *filter; //Only in snapshots taken with a filter set
 } checker_status;
 
 
 
-static checker_status status = { .id_counter = 0, .allocs = NULL, .reallocs = NULL, .frees = NULL, .pointers = NULL, .entry_lookup = NULL };
+//Callsite table doubles as the initialized flag, it exists at every level
+static checker_status status = { .alloc_count = 0, .callsites = { .data = NULL } };
+
+//glibc's default M_MMAP_THRESHOLD, glibc raises its own after freeing mmapped blocks
+#ifndef ALLOC_CHECK_LARGE_THRESHOLD
+#define ALLOC_CHECK_LARGE_THRESHOLD 0x20000
+#endif
+static size_t large_threshold = ALLOC_CHECK_LARGE_THRESHOLD;
+
+int set_alloc_check_large_threshold(size_t size)
+{
+	if (size == 0) return -1;
+
+	LOCK(status_lock);
+	large_threshold = size;
+	UNLOCK(status_lock);
+
+	return 0;
+}
+
+//Must hold status_lock
+static void record_alignment(callsite_stats *site, void *ptr, size_t size)
+{
+	uintptr_t address = (uintptr_t)ptr;
+
+	int bucket = __builtin_ctzll(address | ((uintptr_t)1 << (ALIGN_MIN_SHIFT + ALIGN_BUCKETS - 1))) - ALIGN_MIN_SHIFT;
+	site->alignments[bucket < 0 ? 0 : bucket]++;
+
+	if (size <= ALLOC_CHECK_CACHE_LINE && address % ALLOC_CHECK_CACHE_LINE + size > ALLOC_CHECK_CACHE_LINE)
+		site->line_splits++;
+	if (size >= ALLOC_CHECK_SIMD_WIDTH && address % ALLOC_CHECK_SIMD_WIDTH != 0)
+		site->simd_misaligned++;
+}
+
+//Must hold status_lock
+static void record_realloc_move(callsite_stats *site, void *ptr, void *new_ptr, size_t old_size, size_t size)
+{
+	if (new_ptr == ptr)
+	{
+		site->reallocs_in_place++;
+		return;
+	}
+
+	site->reallocs_moved++;
+	site->realloc_copied_bytes += old_size < size ? old_size : size;
+}
+
+//Must hold status_lock
+static void record_large_alloc(callsite_stats *site, size_t size)
+{
+	if (size < large_threshold) return;
+
+	site->large_allocs++;
+	site->large_bytes += size;
+}
 
 
 
 static void init_checker()
 {
-	if (status.allocs != NULL) return;
+	if (status.callsites.data != NULL) return;
 
-	status.allocs = create_voidptr_array();
-	status.reallocs = create_voidptr_array();
-	status.frees = create_voidptr_array();
-	status.pointers = create_voidptr_array();
-	status.entry_lookup = create_voidptr_array();
+	init_callsite_table(&status.callsites);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	init_live_index(&status.live);
+	status.id_counter = 1;
+#endif
+
+	for (int i = 0; i < NULL_OP_COUNT; i++)
+	{
+		status.null_samples[i] = create_voidptr_array();
+		status.null_seen[i] = 0;
+	}
+	status.sample_seed = 0x2545F4914F6CDD1Dull;
 
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
 	//Special null pointer case
-	append_voidptr_array(status.pointers, NULL);
+	status.entry_lookup = create_voidptr_array();
+	status.entry_ids = meta_malloc(status.entry_lookup->capacity * sizeof(size_t));
+	DIE_NULL(status.entry_ids);
+	status.entry_ids[0] = 0;
+	status.entry_holes = 0;
 	append_voidptr_array(status.entry_lookup, create_voidptr_array());
-	status.id_counter = 1;
+	status.kept = create_voidptr_array();
+	status.live_entries = 0;
+	status.kept_entries = 0;
+#endif
 }
 
-static size_t find_id(void *ptr)
+#if ALLOC_CHECK_THREAD_SAFE
+//Must hold status_lock
+static thread_stats *current_thread()
 {
-	for (size_t i = 0; i < status.pointers->count; i++)
+	if (thread_index < 0)
 	{
-		if (status.pointers->data[i] == ptr)
-			return i;
+		thread_index = status.thread_count < ALLOC_CHECK_MAX_THREADS ? status.thread_count++ : ALLOC_CHECK_MAX_THREADS - 1;
+		if (status.threads[thread_index].tid == 0) status.threads[thread_index].tid = gettid();
 	}
 
-	return 0; //Both NULL and unlisted will be 0
+	return &status.threads[thread_index];
 }
+#endif
 
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+//Captured by each checked_* before taking the lock, copied into the entries it creates
+static __thread void *pending_stack[ALLOC_CHECK_STACK_DEPTH];
 
-
-memory_entry *create_memory_entry(int type, size_t id, void *old_ptr, void *new_ptr, size_t size, char *file_name, int line)
+//Inlined so the first frame kept is the caller of checked_*
+#define CAPTURE_STACK() capture_stack()
+static inline __attribute__((always_inline)) void capture_stack()
 {
-	memory_entry *entry = malloc(sizeof(memory_entry));
-	DIE_NULL(entry);
-	char *name = malloc(strlen(file_name) + 1);
-	DIE_NULL(name);
-	strcpy(name, file_name);
+	void *frames[ALLOC_CHECK_STACK_DEPTH + 1];
+	int count = backtrace(frames, ALLOC_CHECK_STACK_DEPTH + 1);
 
+	//Skip checked_* itself
+	for (int i = 0; i < ALLOC_CHECK_STACK_DEPTH; i++)
+		pending_stack[i] = i + 1 < count ? frames[i + 1] : NULL;
+}
+#else
+#define CAPTURE_STACK() do { } while (0)
+#endif
+
+static void init_memory_entry(memory_entry *entry, int type, size_t id, void *old_ptr, void *new_ptr, size_t size, callsite_stats *site)
+{
 	entry->id = id;
 	entry->type = type;
 	entry->old_ptr = old_ptr;
 	entry->new_ptr = new_ptr;
 	entry->size = size;
-	entry->file_name = name;
-	entry->line = line;
+	entry->site = site;
+#if ALLOC_CHECK_THREAD_SAFE
+	current_thread();
+	entry->thread = thread_index;
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	memcpy(entry->stack, pending_stack, sizeof(entry->stack));
+#endif
+}
 
+memory_entry *create_memory_entry(int type, size_t id, void *old_ptr, void *new_ptr, size_t size, callsite_stats *site)
+{
+	memory_entry *entry = meta_malloc(sizeof(memory_entry));
+	DIE_NULL(entry);
+
+	init_memory_entry(entry, type, id, old_ptr, new_ptr, size, site);
 	return entry;
 }
 
 void destroy_memory_entry(memory_entry *entry)
 {
-	free(entry->file_name);
-	free(entry);
+	meta_free(entry);
+}
+
+static uint64_t next_sample_random()
+{
+	//xorshift64
+	uint64_t x = status.sample_seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	status.sample_seed = x;
+	return x;
+}
+
+static void record_null_op(int kind, int type, void *old_ptr, size_t size, callsite_stats *site)
+{
+	voidptr_array *sample = status.null_samples[kind];
+	size_t seen = ++status.null_seen[kind];
+
+	if (sample->count < NULL_SAMPLE_SIZE)
+	{
+		append_voidptr_array(sample, create_memory_entry(type, 0, old_ptr, NULL, size, site));
+		return;
+	}
+
+	//Algorithm R, keeps each op with probability NULL_SAMPLE_SIZE / seen
+	size_t slot = next_sample_random() % seen;
+	if (slot >= NULL_SAMPLE_SIZE) return;
+
+	destroy_memory_entry(sample->data[slot]);
+	sample->data[slot] = create_memory_entry(type, 0, old_ptr, NULL, size, site);
 }
 
 char *entry_type_str(int type)
@@ -277,580 +1509,4399 @@ char *entry_type_str(int type)
 
 
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wuse-after-free"
-void *checked_malloc(size_t size, char *file_name, int line)
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//Block classification, shared by the counting and printing passes
+static char is_block_lost(voidptr_array *entries)
 {
-	init_checker();
-
-	void *ptr = malloc(size);
+	//Position 0 holds no block
+	if (entries->count == 0) return 0;
 
-	memory_entry *entry;
-	size_t id;
+	for (size_t j = 0; j < entries->count; j++)
+	{
+		memory_entry *entry = entries->data[j];
+		if (entry->type == ENTRY_FREE) return 0;
+	}
 
-	if (ptr == NULL)
+	return 1;
+}
+static int zero_op_type(voidptr_array *entries)
+{
+	for (size_t j = 0; j < entries->count; j++)
 	{
-		id = 0;
-		entry = create_memory_entry(ENTRY_MALLOC, id, NULL, ptr, size, file_name, line);
+		memory_entry *entry = entries->data[j];
+		if (entry->size != 0) continue;
+
+		if (entry->type == ENTRY_MALLOC || entry->type == ENTRY_CALLOC) return ENTRY_MALLOC;
+		if (entry->type == ENTRY_REALLOC) return ENTRY_REALLOC;
 	}
-	else
+
+	return ENTRY_NVAL;
+}
+static size_t block_id(voidptr_array *entries)
+{
+	//Views may skip blocks, so the position in entry_lookup is not the id
+	memory_entry *first = entries->data[0];
+	return first->id;
+}
+static char is_failed_realloc(memory_entry *entry)
+{
+	return entry->type == ENTRY_REALLOC && entry->size != 0 && entry->new_ptr == NULL;
+}
+static char has_failed_realloc(voidptr_array *entries)
+{
+	for (size_t j = 0; j < entries->count; j++)
 	{
-		id = status.id_counter++;
-		entry = create_memory_entry(ENTRY_MALLOC, id, NULL, ptr, size, file_name, line);
-		append_voidptr_array(status.pointers, ptr); //add index to pointer matching
-		append_voidptr_array(status.entry_lookup, create_voidptr_array()); //create lookup for new id
+		if (is_failed_realloc(entries->data[j])) return 1;
 	}
-	append_voidptr_array(status.allocs, entry); //add to alloc list
-	append_voidptr_array(status.entry_lookup->data[id], entry); //add first entry
 
-	return ptr;
+	return 0;
 }
+#endif
 
-void *checked_calloc(size_t nitems, size_t size, char *file_name, int line)
+
+
+//===Crash-safe state===
+//Mirrors the event log and block states into a file mapping, so they survive a crash
+//Only plain memory stores are done on the hot path, the kernel writes the pages back
+#define MMAP_MAGIC "ACHKMMAP"
+#define MMAP_VERSION 2
+#define MMAP_FILE_NAME_LEN 40
+#define MMAP_MAX_PROBE 64 //Block table slots looked at per pointer, past that a block is dropped
+
+enum MMAP_STATE
 {
-	init_checker();
+	MMAP_STATE_RUNNING = 1,
+	MMAP_STATE_CLEAN = 2,
+};
 
-	void *ptr = malloc(size);
+enum MMAP_BLOCK_STATE
+{
+	MMAP_BLOCK_UNUSED = 0,
+	MMAP_BLOCK_LIVE = 1,
+	MMAP_BLOCK_FREED = 2,
+};
 
-	memory_entry *entry;
-	size_t id;
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t event_size;
+	uint32_t block_size;
+	uint64_t capacity; //Event ring length, and block table slots
+	uint64_t event_offset;
+	uint64_t block_offset;
+	uint64_t pid;
+	volatile uint64_t state;
+	volatile uint64_t event_count; //Total events, ring keeps the last 'capacity'
+	volatile uint64_t block_count; //Blocks ever tracked
+	volatile uint64_t dropped_blocks; //Blocks that found no free slot within MMAP_MAX_PROBE
+} mmap_header;
 
-	if (ptr == NULL)
+typedef struct
+{
+	uint64_t id;
+	uint32_t type;
+	int32_t line;
+	uint64_t old_ptr, new_ptr;
+	uint64_t size;
+	char file_name[MMAP_FILE_NAME_LEN];
+} mmap_event;
+
+//Open addressing on the live pointer, a freed slot is reused by the next block probing past it
+typedef struct
+{
+	uint64_t ptr;
+	uint64_t size;
+	uint64_t id;
+	uint64_t last_event;
+	volatile uint64_t state; //Written last, a slot is only read as live once complete
+} mmap_block;
+
+static struct
+{
+	int fd;
+	size_t length;
+	mmap_header *header;
+	mmap_event *events;
+	mmap_block *blocks;
+} mmap_state = { .fd = -1, .length = 0, .header = NULL, .events = NULL, .blocks = NULL };
+
+static int map_state_file(char *path, size_t capacity)
+{
+	if (mmap_state.header != NULL || capacity == 0) return -1;
+
+	size_t length = sizeof(mmap_header) + capacity * (sizeof(mmap_event) + sizeof(mmap_block));
+
+	//Holds heap addresses and source paths, owner only even when the file is left from an earlier run
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) return -1;
+
+	if (fchmod(fd, 0600) != 0 || ftruncate(fd, length) != 0)
 	{
-		id = 0;
-		entry = create_memory_entry(ENTRY_CALLOC, id, NULL, ptr, size, file_name, line);
+		close(fd);
+		return -1;
 	}
-	else
+
+	void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
 	{
-		id = status.id_counter++;
-		entry = create_memory_entry(ENTRY_CALLOC, id, NULL, ptr, nitems * size, file_name, line);
-		append_voidptr_array(status.pointers, ptr); //add index to pointer matching
-		append_voidptr_array(status.entry_lookup, create_voidptr_array()); //create lookup for new id
+		close(fd);
+		return -1;
 	}
-	append_voidptr_array(status.allocs, entry); //add to alloc list
-	append_voidptr_array(status.entry_lookup->data[id], entry); //add first entry
 
-	return ptr;
+	mmap_header *header = map;
+	memcpy(header->magic, MMAP_MAGIC, 8);
+	header->version = MMAP_VERSION;
+	header->header_size = sizeof(mmap_header);
+	header->event_size = sizeof(mmap_event);
+	header->block_size = sizeof(mmap_block);
+	header->capacity = capacity;
+	header->event_offset = sizeof(mmap_header);
+	header->block_offset = sizeof(mmap_header) + capacity * sizeof(mmap_event);
+	header->pid = getpid();
+	header->event_count = 0;
+	header->block_count = 0;
+	header->dropped_blocks = 0;
+	header->state = MMAP_STATE_RUNNING;
+
+	mmap_state.fd = fd;
+	mmap_state.length = length;
+	mmap_state.header = header;
+	mmap_state.events = (mmap_event *)((char *)map + header->event_offset);
+	mmap_state.blocks = (mmap_block *)((char *)map + header->block_offset);
+
+	return 0;
 }
 
-void *checked_realloc(void *ptr, size_t size, char *file_name, int line)
+int enable_alloc_check_mmap(char *path, size_t capacity)
 {
-	init_checker();
+	LOCK(status_lock);
+	int ret = map_state_file(path, capacity);
+	UNLOCK(status_lock);
 
-	void *new_ptr = realloc(ptr, size);
+	return ret;
+}
 
-	size_t id = find_id(ptr);
-	memory_entry *entry = create_memory_entry(ENTRY_REALLOC, id, ptr, new_ptr, size, file_name, line);
-	append_voidptr_array(status.reallocs, entry);
+static void disable_alloc_check_mmap()
+{
+	if (mmap_state.header == NULL) return;
 
-	//update id to pointer matching, if not NULL or unlisted
-	//if returned NULL, keep pointer to check for future frees
-	if (id != 0 && new_ptr != NULL)
-		status.pointers->data[id] = new_ptr;
-	append_voidptr_array(status.entry_lookup->data[id], entry);
+	mmap_state.header->state = MMAP_STATE_CLEAN;
+	munmap(mmap_state.header, mmap_state.length);
+	close(mmap_state.fd);
 
-	return new_ptr;
+	mmap_state.fd = -1;
+	mmap_state.length = 0;
+	mmap_state.header = NULL;
+	mmap_state.events = NULL;
+	mmap_state.blocks = NULL;
 }
 
-void checked_free(void *ptr, char *file_name, int line)
+static mmap_block *find_mmap_block(mmap_header *header, void *ptr)
 {
-	init_checker();
+	if (ptr == NULL) return NULL;
 
-	free(ptr);
+	uint64_t slot = hash_pointer(ptr) % header->capacity;
 
-	size_t id = find_id(ptr);
-	memory_entry *entry = create_memory_entry(ENTRY_FREE, id, ptr, NULL, 0, file_name, line);
-	append_voidptr_array(status.frees, entry);
-	append_voidptr_array(status.entry_lookup->data[id], entry);
+	for (int i = 0; i < MMAP_MAX_PROBE; i++)
+	{
+		mmap_block *block = &mmap_state.blocks[slot];
+		if (block->state == MMAP_BLOCK_UNUSED) return NULL;
+		if (block->state == MMAP_BLOCK_LIVE && block->ptr == (uintptr_t)ptr) return block;
+		slot = slot + 1 == header->capacity ? 0 : slot + 1;
+	}
 
-	//In most cases, block won't be touched after free, so we can trim to reduce memory usage
-	//Id is preserved in case the block is referenced again
-	trim_voidptr_array(status.entry_lookup->data[id]);
+	return NULL;
 }
-#pragma GCC diagnostic pop
-
 
-
-static void find_lost_blocks(size_t **block_array, size_t *block_count, size_t *total_size)
+//First slot not holding a live block, NULL if the probe limit is reached
+static mmap_block *claim_mmap_block(mmap_header *header, void *ptr)
 {
-	size_t *blockv = NULL;
-	size_t blockc = 0;
-	size_t size = 0;
+	uint64_t slot = hash_pointer(ptr) % header->capacity;
 
-	//Skip id=0 (NULL/invalid)
-	for (size_t i = 1; i < status.entry_lookup->count; i++)
+	for (int i = 0; i < MMAP_MAX_PROBE; i++)
 	{
-		char freed = 0;
-		size_t last_size = 0;
-		voidptr_array *current_block = status.entry_lookup->data[i];
+		mmap_block *block = &mmap_state.blocks[slot];
+		if (block->state != MMAP_BLOCK_LIVE) return block;
+		slot = slot + 1 == header->capacity ? 0 : slot + 1;
+	}
 
-		for (size_t j = 0; j < current_block->count; j++)
-		{
-			memory_entry *current_entry = current_block->data[j];
-			last_size = current_entry->size;
+	return NULL;
+}
 
-			if (current_entry->type == ENTRY_FREE)
-			{
-				freed = 1;
-				break; //REVIEW: Break needed? should be last entry
-			}
+static void record_mmap_event(int type, size_t id, void *old_ptr, void *new_ptr, size_t size, char *file_name, int line)
+{
+	mmap_header *header = mmap_state.header;
+	if (header == NULL) return;
+
+	uint64_t index = header->event_count;
+	mmap_event *event = &mmap_state.events[index % header->capacity];
+
+	event->id = id;
+	event->type = type;
+	event->line = line;
+	event->old_ptr = (uintptr_t)old_ptr;
+	event->new_ptr = (uintptr_t)new_ptr;
+	event->size = size;
+	if (line == CHKD_RETURN_ADDRESS_LINE)
+		memcpy(event->file_name, &file_name, sizeof(file_name)); //Raw address, formatted by the reader
+	else
+	{
+		strncpy(event->file_name, file_name, MMAP_FILE_NAME_LEN - 1);
+		event->file_name[MMAP_FILE_NAME_LEN - 1] = '\0';
+	}
+
+	//Publish only after the record is complete
+	__atomic_store_n(&header->event_count, index + 1, __ATOMIC_RELEASE);
+
+	if (id == 0) return;
+
+	mmap_block *block = find_mmap_block(header, old_ptr);
+	char tracked = block != NULL;
+
+	if (type == ENTRY_FREE)
+	{
+		if (block != NULL) block->state = MMAP_BLOCK_FREED;
+		return;
+	}
+
+	if (new_ptr == NULL)
+	{
+		//Failed realloc, the old block stays live
+		if (block != NULL) block->last_event = index;
+		return;
+	}
+
+	//A moved block gives its slot up, one resized in place keeps it
+	if (block != NULL && old_ptr != new_ptr)
+	{
+		block->state = MMAP_BLOCK_FREED;
+		block = NULL;
+	}
+
+	if (block == NULL)
+	{
+		block = claim_mmap_block(header, new_ptr);
+		if (block == NULL)
+		{
+			header->dropped_blocks++;
+			return;
+		}
+		if (!tracked) header->block_count++;
+	}
+
+	block->ptr = (uintptr_t)new_ptr;
+	block->size = size;
+	block->id = id;
+	block->last_event = index;
+	__atomic_store_n(&block->state, MMAP_BLOCK_LIVE, __ATOMIC_RELEASE);
+}
+
+
+
+//===Flight recorder===
+//Fixed-size ring of the last events, dumped with async-signal-safe calls on fatal signals
+#ifndef FLIGHT_RECORDER_SIZE
+#define FLIGHT_RECORDER_SIZE 4096 //Must be a power of 2
+#endif
+#define FLIGHT_ALT_STACK_SIZE 0x10000
+
+typedef struct
+{
+	volatile uint64_t seq; //Event number + 1, 0 while being written
+	int type;
+	int line;
+	size_t id;
+	void *old_ptr, *new_ptr;
+	size_t size;
+	char *file_name;
+} flight_event;
+
+static flight_event flight_ring[FLIGHT_RECORDER_SIZE];
+static uint64_t flight_head = 0;
+static char flight_enabled = 0;
+static char flight_alt_stack[FLIGHT_ALT_STACK_SIZE]; //Installing thread's
+static char flight_handlers_installed = 0;
+static pthread_key_t flight_stack_key; //Other threads' stacks, freed when they exit
+static __thread char flight_thread_checked = 0;
+
+//Only 1 in flight_sample_every events is kept, both guarded by status_lock
+static size_t flight_sample_every = 1;
+static size_t flight_sample_skip = 0;
+
+void enable_alloc_check_flight_recorder()
+{
+	flight_enabled = 1;
+}
+
+int set_alloc_check_trace_sampling(size_t every)
+{
+	if (every == 0) return -1;
+
+	LOCK(status_lock);
+	flight_sample_every = every;
+	flight_sample_skip = 0;
+	UNLOCK(status_lock);
+	return 0;
+}
+
+static void release_flight_alt_stack(void *stack)
+{
+	stack_t disable = { .ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE };
+	sigaltstack(&disable, NULL);
+	free(stack);
+}
+
+//Alternate stacks are per thread, others than the installing one get theirs on their first recorded event
+static void ensure_flight_alt_stack()
+{
+	if (!__atomic_load_n(&flight_handlers_installed, __ATOMIC_ACQUIRE) || flight_thread_checked) return;
+	flight_thread_checked = 1;
+
+	//Keep a stack the program set up itself
+	stack_t current;
+	if (sigaltstack(NULL, &current) != 0 || !(current.ss_flags & SS_DISABLE)) return;
+
+	void *stack = malloc(FLIGHT_ALT_STACK_SIZE);
+	if (stack == NULL) return;
+
+	stack_t alt_stack = { .ss_sp = stack, .ss_size = FLIGHT_ALT_STACK_SIZE, .ss_flags = 0 };
+	if (sigaltstack(&alt_stack, NULL) != 0 || pthread_setspecific(flight_stack_key, stack) != 0)
+		release_flight_alt_stack(stack);
+}
+
+//Must hold status_lock
+static void record_flight_event(int type, size_t id, void *old_ptr, void *new_ptr, size_t size, char *file_name, int line)
+{
+	if (!flight_enabled) return;
+	ensure_flight_alt_stack();
+	if (flight_sample_skip != 0)
+	{
+		flight_sample_skip--;
+		return;
+	}
+	flight_sample_skip = flight_sample_every - 1;
+
+	uint64_t index = __atomic_fetch_add(&flight_head, 1, __ATOMIC_RELAXED);
+	flight_event *event = &flight_ring[index & (FLIGHT_RECORDER_SIZE - 1)];
+
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->type = type;
+	event->line = line;
+	event->id = id;
+	event->old_ptr = old_ptr;
+	event->new_ptr = new_ptr;
+	event->size = size;
+	event->file_name = file_name;
+	__atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+//Async-signal-safe formatting, no stdio allowed here
+static size_t flight_put_str(char *buff, size_t len, size_t cap, const char *str)
+{
+	while (*str && len < cap) buff[len++] = *str++;
+	return len;
+}
+
+static size_t flight_put_num(char *buff, size_t len, size_t cap, uint64_t value, int base)
+{
+	char digits[24];
+	size_t count = 0;
+
+	do
+	{
+		digits[count++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value != 0);
+
+	if (base == 16) len = flight_put_str(buff, len, cap, "0x");
+	while (count > 0 && len < cap) buff[len++] = digits[--count];
+	return len;
+}
+
+void dump_alloc_check_flight_recorder(int fd)
+{
+	char line[256];
+	size_t len;
+	uint64_t head = __atomic_load_n(&flight_head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > FLIGHT_RECORDER_SIZE ? head - FLIGHT_RECORDER_SIZE : 0;
+
+	len = flight_put_str(line, 0, sizeof(line), "alloc_check flight recorder: last ");
+	len = flight_put_num(line, len, sizeof(line), head - first, 10);
+	len = flight_put_str(line, len, sizeof(line), " of ");
+	len = flight_put_num(line, len, sizeof(line), head, 10);
+	len = flight_put_str(line, len, sizeof(line), " events\n");
+	write(fd, line, len);
+
+	for (uint64_t i = first; i < head; i++)
+	{
+		//Copied then checked again, a writer that started meanwhile makes it torn
+		flight_event *slot = &flight_ring[i & (FLIGHT_RECORDER_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) continue; //Overwritten or being written
+		flight_event copy = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1) continue;
+		flight_event *event = &copy;
+
+		len = flight_put_str(line, 0, sizeof(line), "#");
+		len = flight_put_num(line, len, sizeof(line), i, 10);
+		len = flight_put_str(line, len, sizeof(line), " ");
+		len = flight_put_str(line, len, sizeof(line), entry_type_str(event->type));
+		len = flight_put_str(line, len, sizeof(line), " block=");
+		len = flight_put_num(line, len, sizeof(line), event->id, 10);
+		len = flight_put_str(line, len, sizeof(line), " size=");
+		len = flight_put_num(line, len, sizeof(line), event->size, 10);
+		len = flight_put_str(line, len, sizeof(line), " old=");
+		len = flight_put_num(line, len, sizeof(line), (uintptr_t)event->old_ptr, 16);
+		len = flight_put_str(line, len, sizeof(line), " new=");
+		len = flight_put_num(line, len, sizeof(line), (uintptr_t)event->new_ptr, 16);
+		len = flight_put_str(line, len, sizeof(line), " at ");
+		if (event->line == CHKD_RETURN_ADDRESS_LINE)
+			len = flight_put_num(line, len, sizeof(line), (uintptr_t)event->file_name, 16);
+		else
+		{
+			len = flight_put_str(line, len, sizeof(line), event->file_name);
+			len = flight_put_str(line, len, sizeof(line), ":");
+			len = flight_put_num(line, len, sizeof(line), event->line, 10);
+		}
+		if (len == sizeof(line)) len--;
+		line[len++] = '\n';
+		write(fd, line, len);
+	}
+}
+
+static void flight_signal_handler(int sig)
+{
+	static const char msg[] = "\nalloc_check: fatal signal caught, dumping flight recorder\n";
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	dump_alloc_check_flight_recorder(STDERR_FILENO);
+
+	//Handler was installed with SA_RESETHAND, re-raise for the default action
+	raise(sig);
+}
+
+void install_alloc_check_signal_handlers()
+{
+	enable_alloc_check_flight_recorder();
+
+	//Alternate stack so stack overflows can still be reported, other threads set up theirs lazily
+	if (!flight_handlers_installed)
+	{
+		stack_t current;
+		flight_thread_checked = 1;
+		if (sigaltstack(NULL, &current) == 0 && (current.ss_flags & SS_DISABLE))
+		{
+			stack_t alt_stack = { .ss_sp = flight_alt_stack, .ss_size = FLIGHT_ALT_STACK_SIZE, .ss_flags = 0 };
+			sigaltstack(&alt_stack, NULL);
+		}
+		if (pthread_key_create(&flight_stack_key, release_flight_alt_stack) == 0)
+			__atomic_store_n(&flight_handlers_installed, 1, __ATOMIC_RELEASE);
+	}
+	else
+		ensure_flight_alt_stack();
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = flight_signal_handler;
+	action.sa_flags = SA_RESETHAND | SA_ONSTACK | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGSEGV, &action, NULL);
+	sigaction(SIGABRT, &action, NULL);
+	sigaction(SIGBUS, &action, NULL);
+}
+
+
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//===Block histories===
+//Must hold status_lock, room for 'count' more histories
+static void reserve_histories(size_t count)
+{
+	size_t capacity = status.entry_lookup->capacity;
+	ensure_voidptr_array(status.entry_lookup, status.entry_lookup->count + count);
+	if (status.entry_lookup->capacity == capacity) return;
+
+	size_t *tmp = meta_realloc(status.entry_ids, status.entry_lookup->capacity * sizeof(size_t));
+	DIE_NULL(tmp);
+	status.entry_ids = tmp;
+}
+
+//Must hold status_lock, ids only ever grow so new histories go last
+static void add_history(size_t id, voidptr_array *entries)
+{
+	reserve_histories(1);
+	status.entry_ids[status.entry_lookup->count] = id;
+	status.entry_lookup->data[status.entry_lookup->count++] = entries;
+}
+
+//Position of 'id' in entry_lookup, 0 if it is not there
+static size_t find_history(size_t id)
+{
+	size_t low = 1, high = status.entry_lookup->count;
+
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (status.entry_ids[mid] < id) low = mid + 1;
+		else high = mid;
+	}
+
+	return low < status.entry_lookup->count && status.entry_ids[low] == id ? low : 0;
+}
+
+//Must hold status_lock
+static void compact_histories()
+{
+	if (status.entry_holes == 0) return;
+
+	size_t head = 1;
+	for (size_t i = 1; i < status.entry_lookup->count; i++)
+	{
+		if (status.entry_lookup->data[i] == NULL) continue;
+		status.entry_ids[head] = status.entry_ids[i];
+		status.entry_lookup->data[head++] = status.entry_lookup->data[i];
+	}
+
+	status.entry_lookup->count = head;
+	status.entry_holes = 0;
+}
+
+//Must hold status_lock, holes are squeezed out once they are half of entry_lookup
+static void drop_history(size_t id)
+{
+	size_t position = find_history(id);
+	if (position == 0) return;
+
+	status.entry_lookup->data[position] = NULL;
+	status.entry_holes++;
+	if (status.entry_holes * 2 > status.entry_lookup->count) compact_histories();
+}
+
+
+
+//===History spill===
+//Histories of freed blocks can be moved to an append-only file, keeping only live blocks in memory
+//Kept histories (see checker_status) are not spilled, so reports never read the file
+#ifndef ALLOC_CHECK_SPILL_BUFFER
+#define ALLOC_CHECK_SPILL_BUFFER 65536 //Bytes collected before each write
+#endif
+
+//Where a spilled history is in the file
+typedef struct
+{
+	size_t id;
+	uint64_t first; //Entry number in the file
+	size_t count;
+} spill_record;
+
+static struct
+{
+	int fd;
+	char failed; //A write failed, nothing more is spilled but the file is still read back
+	uint64_t offset; //End of what was written, the buffer goes there next
+	char *buffer;
+	size_t buffered;
+
+	//Appended in free order, the first 'sorted' ones are kept in id order
+	spill_record *records;
+	size_t record_count;
+	size_t record_capacity;
+	size_t sorted;
+} spill_state = { .fd = -1, .failed = 0, .offset = 0, .buffer = NULL, .buffered = 0,
+	.records = NULL, .record_count = 0, .record_capacity = 0, .sorted = 0 };
+
+int enable_alloc_check_history_spill(char *path)
+{
+	LOCK(status_lock);
+
+	if (spill_state.fd >= 0)
+	{
+		UNLOCK(status_lock);
+		return -1;
+	}
+
+	//Histories hold heap addresses and source paths, owner only even when the file is left from an earlier run
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || fchmod(fd, 0600) != 0)
+	{
+		if (fd >= 0) close(fd);
+		UNLOCK(status_lock);
+		return -1;
+	}
+
+	spill_state.buffer = meta_malloc(ALLOC_CHECK_SPILL_BUFFER);
+	DIE_NULL(spill_state.buffer);
+	spill_state.buffered = 0;
+	spill_state.fd = fd;
+	spill_state.failed = 0;
+	spill_state.offset = 0;
+
+	UNLOCK(status_lock);
+	return 0;
+}
+
+static void disable_alloc_check_history_spill()
+{
+	meta_free(spill_state.buffer);
+	spill_state.buffer = NULL;
+	spill_state.buffered = 0;
+
+	meta_free(spill_state.records);
+	spill_state.records = NULL;
+	spill_state.record_count = 0;
+	spill_state.record_capacity = 0;
+	spill_state.sorted = 0;
+
+	if (spill_state.fd < 0) return;
+
+	close(spill_state.fd);
+	spill_state.fd = -1;
+	spill_state.offset = 0;
+}
+
+//Must hold status_lock, returns 0 and stops spilling if the file can not be written (disk full or similar),
+//buffered entries of histories already freed are counted in spill_lost then, the last 'unfreed' ones and
+//later histories stay in memory
+static char flush_spill_buffer(size_t unfreed)
+{
+	size_t done = 0;
+
+	while (done < spill_state.buffered)
+	{
+		ssize_t wrote = pwrite(spill_state.fd, spill_state.buffer + done, spill_state.buffered - done, spill_state.offset + done);
+		if (wrote <= 0)
+		{
+			status.spill_lost += spill_state.buffered / sizeof(memory_entry) - unfreed;
+			spill_state.failed = 1;
+			spill_state.buffered = 0;
+			return 0;
+		}
+		done += wrote;
+	}
+
+	spill_state.offset += done;
+	spill_state.buffered = 0;
+	return 1;
+}
+
+//Must hold status_lock
+static void add_spill_record(size_t id, uint64_t first, size_t count)
+{
+	if (spill_state.record_count == spill_state.record_capacity)
+	{
+		size_t capacity = spill_state.record_capacity ? spill_state.record_capacity << 1 : 1024;
+		spill_record *tmp = meta_realloc(spill_state.records, capacity * sizeof(spill_record));
+		DIE_NULL(tmp);
+
+		spill_state.records = tmp;
+		spill_state.record_capacity = capacity;
+	}
+
+	spill_record *record = &spill_state.records[spill_state.record_count++];
+	record->id = id;
+	record->first = first;
+	record->count = count;
+}
+
+//Must hold status_lock, records appended since the last lookup are radix sorted by id and merged in
+static void sort_spill_records()
+{
+	size_t tail = spill_state.record_count - spill_state.sorted;
+	if (tail == 0) return;
+
+	spill_record *temp = meta_malloc(tail * sizeof(spill_record));
+	DIE_NULL(temp);
+
+	spill_record *src = spill_state.records + spill_state.sorted, *dest = temp;
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+
+		for (size_t i = 0; i < tail; i++)
+			offsets[(src[i].id >> shift) & 0xFF]++;
+		if (offsets[(src[0].id >> shift) & 0xFF] == tail) continue;
+
+		for (size_t i = 0, sum = 0; i < 256; i++)
+		{
+			size_t bucket = offsets[i];
+			offsets[i] = sum;
+			sum += bucket;
+		}
+
+		for (size_t i = 0; i < tail; i++)
+			dest[offsets[(src[i].id >> shift) & 0xFF]++] = src[i];
+
+		spill_record *tmp = src;
+		src = dest;
+		dest = tmp;
+	}
+	if (src != temp) memcpy(temp, src, tail * sizeof(spill_record));
+
+	//Merged from the back, the sorted head never gets overwritten before it is read
+	size_t i = spill_state.sorted, j = tail, k = spill_state.record_count;
+	while (j > 0)
+	{
+		if (i > 0 && spill_state.records[i - 1].id > temp[j - 1].id) spill_state.records[--k] = spill_state.records[--i];
+		else spill_state.records[--k] = temp[--j];
+	}
+
+	meta_free(temp);
+	spill_state.sorted = spill_state.record_count;
+}
+
+//Must hold status_lock, NULL if the history of 'id' was never spilled
+static spill_record *find_spill_record(size_t id)
+{
+	sort_spill_records();
+
+	size_t low = 0, high = spill_state.record_count;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (spill_state.records[mid].id < id) low = mid + 1;
+		else high = mid;
+	}
+
+	return low < spill_state.record_count && spill_state.records[low].id == id ? &spill_state.records[low] : NULL;
+}
+
+//Must hold status_lock, 'entries' is freed along with its history once spilled
+static void spill_block(size_t id, voidptr_array *entries)
+{
+	if (spill_state.fd < 0 || spill_state.failed) return;
+
+	//Entries of this history already in the buffer, it is only freed once all of them are
+	uint64_t first = (spill_state.offset + spill_state.buffered) / sizeof(memory_entry);
+	size_t buffered = 0;
+	for (size_t i = 0; i < entries->count; i++)
+	{
+		if (spill_state.buffered + sizeof(memory_entry) > ALLOC_CHECK_SPILL_BUFFER)
+		{
+			if (!flush_spill_buffer(buffered)) return;
+			buffered = 0;
+		}
+		memcpy(spill_state.buffer + spill_state.buffered, entries->data[i], sizeof(memory_entry));
+		spill_state.buffered += sizeof(memory_entry);
+		buffered++;
+	}
+	add_spill_record(id, first, entries->count);
+
+	for (size_t i = 0; i < entries->count; i++)
+		destroy_memory_entry(entries->data[i]);
+
+	destroy_voidptr_array(entries);
+	drop_history(id);
+}
+
+//Reads 'count' spilled entries starting at entry 'first' of the file open as 'fd', returns how many were read
+//Needs no lock, 'fd' is a duplicate taken once the buffer was flushed
+static size_t read_spilled_entries(int fd, uint64_t first, size_t count, memory_entry *out)
+{
+	size_t length = count * sizeof(memory_entry);
+	uint64_t offset = first * sizeof(memory_entry);
+	size_t done = 0;
+
+	while (done < length)
+	{
+		ssize_t got = pread(fd, (char *)out + done, length - done, offset + done);
+		if (got <= 0) break;
+		done += got;
+	}
+
+	return done / sizeof(memory_entry);
+}
+#endif
+
+
+
+//===Shared memory stats===
+//Live counters published into a POSIX shared memory segment, see alloc_check_shm.h
+//Totals are written on every operation, the top callsites every ALLOC_CHECK_SHM_REFRESH ones
+#ifndef ALLOC_CHECK_SHM_REFRESH
+#define ALLOC_CHECK_SHM_REFRESH 4096
+#endif
+
+static struct
+{
+	char name[64];
+	alloc_check_shm *shm;
+	size_t until_refresh;
+} shm_state = { .shm = NULL, .until_refresh = 0 };
+
+int enable_alloc_check_shm(char *name)
+{
+	LOCK(status_lock);
+
+	if (shm_state.shm != NULL)
+	{
+		UNLOCK(status_lock);
+		return -1;
+	}
+
+	if (name != NULL)
+		snprintf(shm_state.name, sizeof(shm_state.name), "%s", name);
+	else
+		snprintf(shm_state.name, sizeof(shm_state.name), "/alloc_check.%d", (int)getpid());
+
+	//Owner only, a segment left behind by an earlier run keeps its mode unless changed
+	int fd = shm_open(shm_state.name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	void *map = MAP_FAILED;
+	if (fd >= 0 && fchmod(fd, 0600) == 0 && ftruncate(fd, sizeof(alloc_check_shm)) == 0)
+		map = mmap(NULL, sizeof(alloc_check_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0) close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		if (fd >= 0) shm_unlink(shm_state.name);
+		UNLOCK(status_lock);
+		return -1;
+	}
+
+	alloc_check_shm *shm = map;
+	memcpy(shm->magic, ALLOC_CHECK_SHM_MAGIC, 8);
+	shm->version = ALLOC_CHECK_SHM_VERSION;
+	shm->size = sizeof(alloc_check_shm);
+	shm->pid = getpid();
+	shm->level = ALLOC_CHECK_LEVEL;
+	shm->state = ALLOC_CHECK_SHM_RUNNING;
+
+	shm_state.shm = shm;
+	shm_state.until_refresh = 0;
+
+	UNLOCK(status_lock);
+	return 0;
+}
+
+static void disable_alloc_check_shm()
+{
+	if (shm_state.shm == NULL) return;
+
+	shm_state.shm->state = ALLOC_CHECK_SHM_CLEAN;
+	munmap(shm_state.shm, sizeof(alloc_check_shm));
+	shm_unlink(shm_state.name);
+	shm_state.shm = NULL;
+}
+
+//Live bytes, or allocated bytes below summary level
+static size_t callsite_weight(callsite_stats *site)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	return site->live_bytes;
+#else
+	return site->alloc_bytes;
+#endif
+}
+
+//Heaviest 'max' callsites of 'sites' (NULL slots are skipped) into 'top', returns how many
+static size_t select_top_callsites(callsite_stats **sites, size_t length, callsite_stats **top, size_t max)
+{
+	size_t count = 0;
+
+	//Insertion into a small sorted array, the sites are only walked once
+	for (size_t i = 0; i < length; i++)
+	{
+		callsite_stats *site = sites[i];
+		if (site == NULL) continue;
+
+		size_t weight = callsite_weight(site);
+		if (weight == 0) continue; //Sites that only free
+		if (count == max && weight <= callsite_weight(top[count - 1])) continue;
+
+		size_t j = count < max ? count++ : count - 1;
+		for (; j > 0 && callsite_weight(top[j - 1]) < weight; j--) top[j] = top[j - 1];
+		top[j] = site;
+	}
+
+	return count;
+}
+
+//Must hold status_lock and be inside a seqlock write
+static void publish_shm_top(alloc_check_shm *shm)
+{
+	callsite_stats *top[ALLOC_CHECK_SHM_TOP];
+	size_t count = select_top_callsites(status.callsites.data, status.callsites.capacity, top, ALLOC_CHECK_SHM_TOP);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		alloc_check_shm_site *dest = &shm->top[i];
+
+		if (top[i]->line == CHKD_RETURN_ADDRESS_LINE)
+			snprintf(dest->file_name, ALLOC_CHECK_SHM_FILE_NAME_LEN, "%p", top[i]->key);
+		else
+			snprintf(dest->file_name, ALLOC_CHECK_SHM_FILE_NAME_LEN, "%s", top[i]->file_name);
+		dest->line = top[i]->line;
+		dest->allocs = top[i]->allocs;
+		dest->alloc_bytes = top[i]->alloc_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		dest->live_blocks = top[i]->live_blocks;
+		dest->live_bytes = top[i]->live_bytes;
+#endif
+	}
+
+	shm->site_count = status.callsites.count;
+	shm->top_count = count;
+}
+
+//Same measure as callsite_weight
+static size_t type_weight(type_stats *type)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	return type->live_bytes;
+#else
+	return type->alloc_bytes;
+#endif
+}
+
+//Must hold status_lock and be inside a seqlock write, types are ordered like callsites
+static void publish_shm_types(alloc_check_shm *shm)
+{
+	type_stats *top[ALLOC_CHECK_SHM_TYPES];
+	size_t count = 0;
+
+	for (type_stats *type = status.types; type != NULL; type = type->next)
+	{
+		size_t weight = type_weight(type);
+		if (count == ALLOC_CHECK_SHM_TYPES && weight <= type_weight(top[count - 1])) continue;
+
+		size_t j = count < ALLOC_CHECK_SHM_TYPES ? count++ : count - 1;
+		for (; j > 0 && type_weight(top[j - 1]) < weight; j--) top[j] = top[j - 1];
+		top[j] = type;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		alloc_check_shm_type *dest = &shm->types[i];
+
+		snprintf(dest->name, ALLOC_CHECK_SHM_TYPE_NAME_LEN, "%s", top[i]->name);
+		dest->size = top[i]->size;
+		dest->allocs = top[i]->allocs;
+		dest->alloc_bytes = top[i]->alloc_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		dest->live_blocks = top[i]->live_blocks;
+		dest->live_bytes = top[i]->live_bytes;
+		dest->peak_bytes = top[i]->peak_bytes;
+#endif
+	}
+
+	shm->type_count = status.type_count;
+	shm->top_type_count = count;
+}
+
+//Must hold status_lock
+static void publish_shm()
+{
+	alloc_check_shm *shm = shm_state.shm;
+	if (shm == NULL) return;
+
+	//Single writer, so the sequence needs no atomic increment
+	uint64_t seq = shm->seq;
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm->alloc_count = status.alloc_count;
+	shm->realloc_count = status.realloc_count;
+	shm->free_count = status.free_count;
+	shm->alloc_bytes = status.alloc_bytes;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	shm->live_blocks = status.live.count;
+	shm->live_bytes = status.live_bytes;
+	shm->peak_bytes = status.peak_bytes;
+#endif
+
+	if (shm_state.until_refresh == 0)
+	{
+		publish_shm_top(shm);
+		publish_shm_types(shm);
+		shm_state.until_refresh = ALLOC_CHECK_SHM_REFRESH;
+	}
+	shm_state.until_refresh--;
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+
+static void record_event(int type, size_t id, void *old_ptr, void *new_ptr, size_t size, char *file_name, int line)
+{
+	record_mmap_event(type, id, old_ptr, new_ptr, size, file_name, line);
+	record_flight_event(type, id, old_ptr, new_ptr, size, file_name, line);
+}
+
+
+
+//Must hold status_lock
+static type_stats *get_type_stats(chkd_type *type)
+{
+	for (type_stats *stats = status.types; stats != NULL; stats = stats->next)
+	{
+		if (stats->size == type->size && strcmp(stats->name, type->name) == 0)
+			return stats;
+	}
+
+	type_stats *stats = meta_calloc(1, sizeof(type_stats));
+	DIE_NULL(stats);
+	stats->name = type->name;
+	stats->size = type->size;
+
+	stats->next = status.types;
+	status.types = stats;
+	status.type_count++;
+	return stats;
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+//'delta' wraps around when the block shrinks or is freed
+static void add_type_live_bytes(type_stats *type, size_t delta)
+{
+	type->live_bytes += delta;
+	if (type->live_bytes > type->peak_bytes) type->peak_bytes = type->live_bytes;
+}
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//A block's first entry, its history list and the list's first VOIDPTRARR_DEFAULT_CAP slots, in one meta_slab cell
+#define BATCH_ENTRY_SIZE ((sizeof(memory_entry) + 15) & ~(size_t)15)
+#define BATCH_LIST_SIZE ((sizeof(voidptr_array) + 15) & ~(size_t)15)
+#define BATCH_CELL_SIZE (BATCH_ENTRY_SIZE + BATCH_LIST_SIZE + VOIDPTRARR_DEFAULT_CAP * sizeof(void *))
+
+//Cells left for the batch being recorded by record_alloc_batch, empty otherwise
+static struct
+{
+	char *next;
+	char *end;
+} batch_cells = { .next = NULL, .end = NULL };
+#endif
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuse-after-free"
+//Must hold status_lock, returns the new block's id (always 0 at counters level)
+static size_t track_block(int type, void *ptr, size_t size, callsite_stats *site)
+{
+	site->allocs++;
+	site->alloc_bytes += size;
+	status.alloc_bytes += size;
+	record_large_alloc(site, size);
+	record_alignment(site, ptr, size);
+
+#if ALLOC_CHECK_THREAD_SAFE
+	thread_stats *thread = current_thread();
+	thread->allocs++;
+	thread->alloc_bytes += size;
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t id = status.id_counter++;
+
+	live_block *block = insert_live_block(&status.live, ptr);
+	block->size = size;
+	block->id = id;
+	block->site = site;
+#if ALLOC_CHECK_THREAD_SAFE
+	block->thread = thread_index;
+#endif
+
+	site->live_blocks++;
+	site->live_bytes += size;
+	if (site->type != NULL)
+	{
+		site->type->live_blocks++;
+		add_type_live_bytes(site->type, size);
+	}
+
+	status.live_bytes += size;
+	if (status.live_bytes > status.peak_bytes) status.peak_bytes = status.live_bytes;
+#else
+	(void)ptr;
+	size_t id = 0;
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	memory_entry *entry;
+	if (batch_cells.next != batch_cells.end)
+	{
+		entry = (memory_entry *)batch_cells.next;
+		init_memory_entry(entry, type, id, NULL, ptr, size, site);
+
+		block->entries = (voidptr_array *)(batch_cells.next + BATCH_ENTRY_SIZE);
+		block->entries->data = (void **)(batch_cells.next + BATCH_ENTRY_SIZE + BATCH_LIST_SIZE);
+		block->entries->capacity = VOIDPTRARR_DEFAULT_CAP;
+		block->entries->count = 0;
+		batch_cells.next += BATCH_CELL_SIZE;
+	}
+	else
+	{
+		entry = create_memory_entry(type, id, NULL, ptr, size, site);
+		block->entries = create_voidptr_array();
+	}
+	add_history(id, block->entries);
+	append_voidptr_array(block->entries, entry); //add first entry
+	status.live_entries++;
+#else
+	(void)type;
+#endif
+
+	return id;
+}
+
+//Must hold status_lock, the callsite is looked up by the caller
+static void record_alloc_at(callsite_stats *site, int type, void *ptr, size_t size, char *file_name, int line)
+{
+	if (ptr == NULL)
+	{
+		if (size != 0) site->failed_allocs++;
+		else site->zero_allocs++;
+		record_null_op(NULL_OP_ALLOC, type, NULL, size, site);
+		record_event(type, 0, NULL, ptr, size, file_name, line);
+		return;
+	}
+
+	size_t id = track_block(type, ptr, size, site);
+	record_event(type, id, NULL, ptr, size, file_name, line);
+}
+
+//Must hold status_lock
+static void record_alloc(int type, void *ptr, size_t size, char *file_name, int line)
+{
+	status.alloc_count++;
+	record_alloc_at(get_callsite(&status.callsites, file_name, line), type, ptr, size, file_name, line);
+}
+
+//Must hold status_lock, one callsite lookup and one index reservation for the whole batch
+static void record_alloc_batch(void **ptrs, size_t count, size_t size, char *file_name, int line)
+{
+	callsite_stats *site = get_callsite(&status.callsites, file_name, line);
+	status.alloc_count += count;
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	reserve_live_index(&status.live, count);
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	reserve_histories(count);
+
+	//Entries and lists of the whole batch come out of one allocation, failed allocs take no cell
+	size_t tracked = 0;
+	for (size_t i = 0; i < count; i++)
+		if (ptrs[i] != NULL) tracked++;
+
+	batch_cells.next = tracked != 0 ? meta_slab_alloc(BATCH_CELL_SIZE, tracked, 3) : NULL;
+	batch_cells.end = batch_cells.next != NULL ? batch_cells.next + tracked * BATCH_CELL_SIZE : NULL;
+#endif
+
+	for (size_t i = 0; i < count; i++)
+		record_alloc_at(site, ENTRY_MALLOC, ptrs[i], size, file_name, line);
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	batch_cells.next = NULL;
+	batch_cells.end = NULL;
+#endif
+}
+
+//Must hold status_lock
+static void record_new(chkd_type *type, void *ptr, size_t count, char *file_name, int line)
+{
+	callsite_stats *site = get_callsite(&status.callsites, file_name, line);
+	if (site->type == NULL) site->type = get_type_stats(type);
+	status.alloc_count++;
+
+	if (ptr != NULL)
+	{
+		site->type->allocs++;
+		site->type->objects += count;
+		site->type->alloc_bytes += count * type->size;
+		site->type->lengths[length_bucket(count)]++;
+	}
+
+	record_alloc_at(site, ENTRY_CALLOC, ptr, count * type->size, file_name, line);
+}
+
+//Must hold status_lock, 'old_size' is only used below summary level, where there is no live set
+static void record_realloc(void *ptr, void *new_ptr, size_t size, size_t old_size, char *file_name, int line)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	(void)old_size;
+#endif
+	callsite_stats *site = get_callsite(&status.callsites, file_name, line);
+	status.realloc_count++;
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	live_block *block = find_live_block(&status.live, ptr);
+	size_t id = block != NULL ? block->id : 0;
+	char unlisted = block == NULL;
+#else
+	//Without the live set, only NULL can be told apart
+	size_t id = 0;
+	char unlisted = ptr == NULL;
+#endif
+
+	if (unlisted)
+	{
+		//NULL or unlisted, a returned block is still tracked so it can be freed
+		site->null_reallocs++;
+		record_null_op(NULL_OP_REALLOC, ENTRY_REALLOC, ptr, size, site);
+		if (new_ptr != NULL) id = track_block(ENTRY_REALLOC, new_ptr, size, site);
+	}
+	else
+	{
+		if (new_ptr == NULL && size != 0) site->failed_reallocs++;
+		if (new_ptr != NULL)
+		{
+			record_large_alloc(site, size);
+			record_alignment(site, new_ptr, size);
+#if ALLOC_CHECK_LEVEL < ALLOC_CHECK_LEVEL_SUMMARY
+			record_realloc_move(site, ptr, new_ptr, old_size, size);
+#endif
+		}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		//if returned NULL, keep pointer to check for future frees
+		if (new_ptr != NULL)
+		{
+			live_block moved = *block;
+			remove_live_block(&status.live, block);
+			record_realloc_move(site, ptr, new_ptr, moved.size, size);
+
+			//The old mapping goes away unless it was resized in place
+			if (moved.size >= large_threshold && new_ptr != ptr) moved.site->large_frees++;
+
+			moved.site->live_bytes += size - moved.size;
+			if (moved.site->type != NULL) add_type_live_bytes(moved.site->type, size - moved.size);
+			status.live_bytes += size - moved.size;
+			if (status.live_bytes > status.peak_bytes) status.peak_bytes = status.live_bytes;
+
+			moved.size = size;
+#if ALLOC_CHECK_THREAD_SAFE
+			//A moved block was allocated again by this thread
+			if (new_ptr != ptr)
+			{
+				current_thread();
+				moved.thread = thread_index;
+			}
+#endif
+			block = insert_live_block(&status.live, new_ptr);
+			moved.ptr = new_ptr;
+			*block = moved;
+		}
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+		//Moved or not, 'block' is the live slot holding the history
+		memory_entry *entry = create_memory_entry(ENTRY_REALLOC, id, ptr, new_ptr, size, site);
+		append_voidptr_array(block->entries, entry);
+		status.live_entries++;
+#endif
+	}
+
+	record_event(ENTRY_REALLOC, id, ptr, new_ptr, size, file_name, line);
+}
+
+//Must hold status_lock, the callsite is looked up by the caller
+static void record_free_at(callsite_stats *site, void *ptr, char *file_name, int line)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	live_block *block = find_live_block(&status.live, ptr);
+	size_t id = block != NULL ? block->id : 0;
+	char unlisted = block == NULL;
+#else
+	//Without the live set, invalid and double frees count as regular frees
+	size_t id = 0;
+	char unlisted = ptr == NULL;
+#endif
+	record_event(ENTRY_FREE, id, ptr, NULL, 0, file_name, line);
+
+	if (unlisted)
+	{
+		if (ptr == NULL) site->null_frees++;
+		else site->invalid_frees++;
+		record_null_op(NULL_OP_FREE, ENTRY_FREE, ptr, 0, site);
+	}
+	else
+	{
+		site->frees++;
+
+#if ALLOC_CHECK_THREAD_SAFE
+		thread_stats *thread = current_thread();
+		thread->frees++;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		if (block->thread != thread_index) thread->cross_frees++;
+#endif
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		if (block->size >= large_threshold) block->site->large_frees++;
+		block->site->live_blocks--;
+		block->site->live_bytes -= block->size;
+		if (block->site->type != NULL)
+		{
+			block->site->type->live_blocks--;
+			block->site->type->live_bytes -= block->size;
+		}
+		status.live_bytes -= block->size;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+		voidptr_array *entries = block->entries;
+#endif
+		remove_live_block(&status.live, block);
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+		memory_entry *entry = create_memory_entry(ENTRY_FREE, id, ptr, NULL, 0, site);
+		status.live_entries -= entries->count;
+		append_voidptr_array(entries, entry);
+
+		//In most cases, block won't be touched after free, so we can trim (or spill) to reduce memory usage
+		trim_voidptr_array(entries);
+
+		//Zero-sized and failed operations show up in the report, those histories stay in memory
+		if (zero_op_type(entries) != ENTRY_NVAL || has_failed_realloc(entries))
+		{
+			append_voidptr_array(status.kept, entries);
+			status.kept_entries += entries->count;
+		}
+		else
+			spill_block(id, entries);
+#endif
+	}
+}
+
+//Must hold status_lock
+static void record_free(void *ptr, char *file_name, int line)
+{
+	status.free_count++;
+	record_free_at(get_callsite(&status.callsites, file_name, line), ptr, file_name, line);
+}
+
+//Must hold status_lock
+static void record_free_batch(void **ptrs, size_t count, char *file_name, int line)
+{
+	callsite_stats *site = get_callsite(&status.callsites, file_name, line);
+	status.free_count += count;
+
+	for (size_t i = 0; i < count; i++)
+		record_free_at(site, ptrs[i], file_name, line);
+}
+
+
+
+//===Async recording===
+//checked_* only push a fixed-size event into a queue owned by the calling thread,
+//a background thread replays them in global sequence order under status_lock
+#ifndef ALLOC_CHECK_ASYNC_QUEUE
+#define ALLOC_CHECK_ASYNC_QUEUE 4096 //Events per thread, must be a power of 2
+#endif
+#ifndef ALLOC_CHECK_ASYNC_QUEUES
+#define ALLOC_CHECK_ASYNC_QUEUES 64 //Threads past this record synchronously
+#endif
+#define ASYNC_IDLE UINT64_MAX
+#define ASYNC_BATCH 4096 //Events replayed per lock hold
+#define ASYNC_POLL_NS 1000000
+
+typedef struct
+{
+	uint64_t seq;
+	size_t generation; //tracker_generation when pushed, events from before a cleanup are dropped
+	int type;
+	int line;
+	char *file_name;
+	void *ptr, *new_ptr;
+	size_t size;
+	size_t old_size; //Reallocs below summary level, or the object count of a CHKD_NEW
+	chkd_type *new_type; //CHKD_NEW descriptor, NULL otherwise
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	void *stack[ALLOC_CHECK_STACK_DEPTH];
+#endif
+} async_event;
+
+//Single producer (the owning thread), single consumer (whoever holds status_lock)
+typedef struct
+{
+	_Alignas(64) uint64_t tail;
+	uint64_t inflight; //Sequence floor of the event being pushed, ASYNC_IDLE otherwise
+	_Alignas(64) uint64_t head;
+	int thread; //Slot in status.threads, replayed as this thread
+	async_event events[ALLOC_CHECK_ASYNC_QUEUE];
+} async_queue;
+
+#if ALLOC_CHECK_THREAD_SAFE
+static struct
+{
+	char enabled; //Read on every operation
+	char running;
+	uint64_t seq;
+	async_queue *queues[ALLOC_CHECK_ASYNC_QUEUES]; //Kept across cleanups, like the threads owning them
+	int queue_count;
+	pthread_t thread;
+} async = { .enabled = 0, .running = 0, .seq = 0, .queue_count = 0 };
+
+static __thread async_queue *async_self = NULL;
+static __thread char async_unqueued = 0; //Past ALLOC_CHECK_ASYNC_QUEUES, or out of memory
+
+//Returns NULL when the calling thread must record synchronously
+static async_queue *async_queue_self()
+{
+	if (!__atomic_load_n(&async.enabled, __ATOMIC_ACQUIRE)) return NULL;
+	if (async_self != NULL || async_unqueued) return async_self;
+
+	LOCK(status_lock);
+	init_checker();
+	current_thread();
+
+	void *map = MAP_FAILED;
+	if (async.queue_count < ALLOC_CHECK_ASYNC_QUEUES)
+		map = mmap(NULL, sizeof(async_queue), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED)
+		async_unqueued = 1;
+	else
+	{
+		async_self = map;
+		async_self->inflight = ASYNC_IDLE;
+		async_self->thread = thread_index;
+		async.queues[async.queue_count++] = async_self;
+	}
+
+	UNLOCK(status_lock);
+	return async_self;
+}
+
+//Takes the event's sequence number, at the point the operation is ordered at
+static uint64_t async_begin(async_queue *queue)
+{
+	//Announced before the number is taken, so the consumer never replays past an event not pushed yet
+	__atomic_store_n(&queue->inflight, __atomic_load_n(&async.seq, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_fetch_add(&async.seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void replay_async_event(async_queue *queue, async_event *event)
+{
+	//Recorded as the thread that queued it
+	thread_index = queue->thread;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	memcpy(pending_stack, event->stack, sizeof(pending_stack));
+#endif
+
+	if (event->type == ENTRY_REALLOC)
+		record_realloc(event->ptr, event->new_ptr, event->size, event->old_size, event->file_name, event->line);
+	else if (event->type == ENTRY_FREE)
+		record_free(event->ptr, event->file_name, event->line);
+	else if (event->new_type != NULL)
+		record_new(event->new_type, event->new_ptr, event->old_size, event->file_name, event->line);
+	else
+		record_alloc(event->type, event->new_ptr, event->size, event->file_name, event->line);
+}
+
+//Must hold status_lock, replays up to 'max' queued events oldest first, returns how many
+static size_t drain_async_queues(size_t max)
+{
+	if (async.queue_count == 0) return 0;
+
+	//Events at or past the floor of one still being pushed must wait for it
+	uint64_t limit = __atomic_load_n(&async.seq, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < async.queue_count; i++)
+	{
+		uint64_t inflight = __atomic_load_n(&async.queues[i]->inflight, __ATOMIC_SEQ_CST);
+		if (inflight < limit) limit = inflight;
+	}
+
+	int own_thread = thread_index;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	void *own_stack[ALLOC_CHECK_STACK_DEPTH];
+	memcpy(own_stack, pending_stack, sizeof(own_stack));
+#endif
+
+	size_t replayed = 0;
+	while (replayed < max)
+	{
+		async_queue *next = NULL;
+		uint64_t next_seq = limit;
+
+		//Merge by sequence number, there are few queues
+		for (int i = 0; i < async.queue_count; i++)
+		{
+			async_queue *queue = async.queues[i];
+			if (queue->head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) continue;
+
+			uint64_t seq = queue->events[queue->head & (ALLOC_CHECK_ASYNC_QUEUE - 1)].seq;
+			if (seq < next_seq)
+			{
+				next = queue;
+				next_seq = seq;
+			}
+		}
+		if (next == NULL) break;
+
+		//Pushed after cleanup_alloc_checks drained the queues, for blocks the new tracker never saw
+		async_event *event = &next->events[next->head & (ALLOC_CHECK_ASYNC_QUEUE - 1)];
+		if (event->generation == tracker_generation) replay_async_event(next, event);
+		__atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+		replayed++;
+	}
+
+	thread_index = own_thread;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	memcpy(pending_stack, own_stack, sizeof(pending_stack));
+#endif
+	return replayed;
+}
+
+//Returns the generation the event was stamped with
+static size_t async_push(async_queue *queue, async_event *event)
+{
+	//Replayed on the consumer, producers set up their alternate stack here
+	ensure_flight_alt_stack();
+
+	uint64_t tail = queue->tail;
+
+	//Full, wait for the consumer instead of dropping or reordering events
+	while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == ALLOC_CHECK_ASYNC_QUEUE)
+	{
+		if (__atomic_load_n(&async.running, __ATOMIC_ACQUIRE))
+		{
+			sched_yield();
+			continue;
+		}
+
+		//Stopped by cleanup_alloc_checks, nobody else will make room
+		LOCK(status_lock);
+		init_checker();
+		drain_async_queues(ASYNC_BATCH);
+		UNLOCK(status_lock);
+	}
+
+	async_event *slot = &queue->events[tail & (ALLOC_CHECK_ASYNC_QUEUE - 1)];
+	*slot = *event;
+	slot->generation = __atomic_load_n(&tracker_generation, __ATOMIC_ACQUIRE);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+	memcpy(slot->stack, pending_stack, sizeof(slot->stack));
+#endif
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&queue->inflight, ASYNC_IDLE, __ATOMIC_RELEASE);
+	return slot->generation;
+}
+
+static void *async_thread(void *arg)
+{
+	(void)arg;
+
+	while (__atomic_load_n(&async.running, __ATOMIC_ACQUIRE))
+	{
+		LOCK(status_lock);
+		size_t replayed = drain_async_queues(ASYNC_BATCH);
+		if (replayed != 0) publish_shm();
+		UNLOCK(status_lock);
+
+		if (replayed == 0)
+		{
+			struct timespec delay = { .tv_sec = 0, .tv_nsec = ASYNC_POLL_NS };
+			nanosleep(&delay, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+int enable_alloc_check_async()
+{
+	LOCK(status_lock);
+
+	if (async.running)
+	{
+		UNLOCK(status_lock);
+		return -1;
+	}
+
+	init_checker();
+
+	//Anything pushed after the last cleanup belongs to the previous run, and is dropped when drained
+	async.running = 1;
+
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&async.thread, NULL, async_thread, NULL) != 0) async.running = 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (async.running) __atomic_store_n(&async.enabled, 1, __ATOMIC_RELEASE);
+	int result = async.running ? 0 : -1;
+
+	UNLOCK(status_lock);
+	return result;
+}
+
+//Must not hold status_lock, what is left in the queues is replayed by cleanup_alloc_checks
+static void disable_alloc_check_async()
+{
+	if (!__atomic_load_n(&async.running, __ATOMIC_ACQUIRE)) return;
+
+	__atomic_store_n(&async.enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&async.running, 0, __ATOMIC_RELEASE);
+	pthread_join(async.thread, NULL);
+}
+#else
+static async_queue *async_queue_self() { return NULL; }
+static uint64_t async_begin(async_queue *queue) { (void)queue; return 0; }
+static size_t async_push(async_queue *queue, async_event *event) { (void)queue; (void)event; return 0; }
+static size_t drain_async_queues(size_t max) { (void)max; return 0; }
+static void disable_alloc_check_async() { }
+
+int enable_alloc_check_async()
+{
+	return -1;
+}
+#endif
+
+
+
+void *checked_malloc(size_t size, char *file_name, int line)
+{
+	CAPTURE_STACK();
+	void *ptr = malloc(size);
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		async_event event = { .seq = async_begin(queue), .type = ENTRY_MALLOC, .line = line, .file_name = file_name, .new_ptr = ptr, .size = size };
+		async_push(queue, &event);
+		return ptr;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_alloc(ENTRY_MALLOC, ptr, size, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	return ptr;
+}
+
+void *checked_calloc(size_t nitems, size_t size, char *file_name, int line)
+{
+	CAPTURE_STACK();
+	void *ptr = calloc(nitems, size);
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		async_event event = { .seq = async_begin(queue), .type = ENTRY_CALLOC, .line = line, .file_name = file_name, .new_ptr = ptr, .size = nitems * size };
+		async_push(queue, &event);
+		return ptr;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_alloc(ENTRY_CALLOC, ptr, nitems * size, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	return ptr;
+}
+
+void *checked_new(chkd_type *type, size_t count, char *file_name, int line)
+{
+	CAPTURE_STACK();
+	void *ptr = calloc(count, type->size);
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		async_event event = { .seq = async_begin(queue), .type = ENTRY_CALLOC, .line = line, .file_name = file_name, .new_ptr = ptr,
+			.size = count * type->size, .old_size = count, .new_type = type };
+		async_push(queue, &event);
+		return ptr;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_new(type, ptr, count, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	return ptr;
+}
+
+void *checked_realloc(void *ptr, size_t size, char *file_name, int line)
+{
+	CAPTURE_STACK();
+#if ALLOC_CHECK_LEVEL < ALLOC_CHECK_LEVEL_SUMMARY
+	//No live set to look the old size up in afterwards
+	size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+#else
+	size_t old_size = 0;
+#endif
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		//Sequenced before the old block can be freed inside realloc, like checked_free
+		uint64_t seq = async_begin(queue);
+		void *new_ptr = realloc(ptr, size);
+		async_event event = { .seq = seq, .type = ENTRY_REALLOC, .line = line, .file_name = file_name,
+			.ptr = ptr, .new_ptr = new_ptr, .size = size, .old_size = old_size };
+		async_push(queue, &event);
+		return new_ptr;
+	}
+
+	//A moved block is freed inside realloc, held across it so no other thread records its address first
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	void *new_ptr = realloc(ptr, size);
+	record_realloc(ptr, new_ptr, size, old_size, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	return new_ptr;
+}
+
+void checked_free(void *ptr, char *file_name, int line)
+{
+	CAPTURE_STACK();
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		//Sequenced before the free, so whoever gets the block back next is replayed after it
+		async_event event = { .seq = async_begin(queue), .type = ENTRY_FREE, .line = line, .file_name = file_name, .ptr = ptr };
+		free(ptr);
+		async_push(queue, &event);
+		return;
+	}
+
+	//Recorded before the free, so whoever gets the block back next is recorded after it
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_free(ptr, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	free(ptr);
+}
+
+//The generation is the one the chunk event is stamped with, or read in the same lock hold it is recorded in
+static void *checked_chunk_malloc(size_t size, char *file_name, int line, size_t *generation)
+{
+	CAPTURE_STACK();
+	void *ptr = malloc(size);
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		async_event event = { .seq = async_begin(queue), .type = ENTRY_MALLOC, .line = line, .file_name = file_name, .new_ptr = ptr, .size = size };
+		*generation = async_push(queue, &event);
+		return ptr;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_alloc(ENTRY_MALLOC, ptr, size, file_name, line);
+	publish_shm();
+	*generation = tracker_generation;
+	UNLOCK(status_lock);
+
+	return ptr;
+}
+
+//Chunks recorded before the last cleanup are unknown to the tracker, not invalid frees
+static void checked_chunk_free(void *ptr, size_t generation, char *file_name, int line)
+{
+	CAPTURE_STACK();
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		if (generation == __atomic_load_n(&tracker_generation, __ATOMIC_ACQUIRE))
+		{
+			async_event event = { .seq = async_begin(queue), .type = ENTRY_FREE, .line = line, .file_name = file_name, .ptr = ptr };
+			free(ptr);
+			async_push(queue, &event);
+		}
+		else
+			free(ptr);
+		return;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	if (generation == tracker_generation) record_free(ptr, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	free(ptr);
+}
+
+//Blocks are allocated first and recorded under a single lock hold, a batch free is recorded before the blocks are freed
+size_t checked_malloc_batch(size_t count, size_t size, void **out, char *file_name, int line)
+{
+	CAPTURE_STACK();
+	size_t allocated = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = malloc(size);
+		if (out[i] != NULL) allocated++;
+	}
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			async_event event = { .seq = async_begin(queue), .type = ENTRY_MALLOC, .line = line, .file_name = file_name, .new_ptr = out[i], .size = size };
+			async_push(queue, &event);
+		}
+		return allocated;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_alloc_batch(out, count, size, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	return allocated;
+}
+
+void checked_free_batch(void **ptrs, size_t count, char *file_name, int line)
+{
+	CAPTURE_STACK();
+
+	async_queue *queue = async_queue_self();
+	if (queue != NULL)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			async_event event = { .seq = async_begin(queue), .type = ENTRY_FREE, .line = line, .file_name = file_name, .ptr = ptrs[i] };
+			free(ptrs[i]);
+			async_push(queue, &event);
+		}
+		return;
+	}
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	record_free_batch(ptrs, count, file_name, line);
+	publish_shm();
+	UNLOCK(status_lock);
+
+	for (size_t i = 0; i < count; i++)
+		free(ptrs[i]);
+}
+
+chkd_pool *chkd_pool_create(char *name, char *file_name, int line)
+{
+	LOCK(status_lock);
+	init_checker();
+
+	//Metadata, the fallback pool behind meta_calloc needs the lock
+	chkd_pool *pool = meta_calloc(1, sizeof(chkd_pool));
+	DIE_NULL(pool);
+	snprintf(pool->name, POOL_NAME_LEN, "%s", name != NULL ? name : "unnamed");
+	pool->file_name = file_name;
+	pool->line = line;
+
+	pool->registered = 1;
+	pool->next = status.pools;
+	if (status.pools != NULL) status.pools->prev = pool;
+	status.pools = pool;
+	status.pool_count++;
+	status.pools_created++;
+
+	UNLOCK(status_lock);
+	return pool;
+}
+
+//The blocks are released together, no per-block free is recorded
+void chkd_pool_destroy(chkd_pool *pool)
+{
+	if (pool == NULL) return;
+
+	LOCK(status_lock);
+
+	//Pools created before the last cleanup are no longer listed
+	if (pool->registered)
+	{
+		if (pool->prev != NULL) pool->prev->next = pool->next;
+		else status.pools = pool->next;
+		if (pool->next != NULL) pool->next->prev = pool->prev;
+
+		status.pool_count--;
+		status.pools_destroyed++;
+	}
+
+	release_pool_chunks(pool);
+	meta_free(pool);
+
+	UNLOCK(status_lock);
+}
+
+chkd_arena *chkd_arena_create(char *name, char *file_name, int line)
+{
+	LOCK(status_lock);
+	init_checker();
+
+	chkd_arena *arena = meta_calloc(1, sizeof(chkd_arena));
+	DIE_NULL(arena);
+	snprintf(arena->name, POOL_NAME_LEN, "%s", name != NULL ? name : "unnamed");
+	arena->file_name = file_name;
+	arena->line = line;
+
+	arena->registered = 1;
+	arena->next = status.arenas;
+	if (status.arenas != NULL) status.arenas->prev = arena;
+	status.arenas = arena;
+	status.arena_count++;
+	status.arenas_created++;
+
+	UNLOCK(status_lock);
+	return arena;
+}
+
+void chkd_arena_destroy(chkd_arena *arena)
+{
+	if (arena == NULL) return;
+
+	//Chunks are tracked blocks, freed before taking the lock
+	release_arena_chunks(arena);
+
+	LOCK(status_lock);
+
+	if (arena->registered)
+	{
+		if (arena->prev != NULL) arena->prev->next = arena->next;
+		else status.arenas = arena->next;
+		if (arena->next != NULL) arena->next->prev = arena->prev;
+
+		status.arena_count--;
+		status.arenas_destroyed++;
+	}
+
+	meta_free(arena);
+
+	UNLOCK(status_lock);
+}
+#pragma GCC diagnostic pop
+
+
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+static void emit_stack(memory_entry *entry)
+{
+	for (int i = 0; i < ALLOC_CHECK_STACK_DEPTH && entry->stack[i] != NULL; i++)
+		emit("|      %-18p %-45s|\n", entry->stack[i], format_address(entry->stack[i], 45));
+}
+#endif
+
+static void emit_entry(memory_entry *entry, void *ptr, char highlight)
+{
+	if (highlight)
+	{
+		set_color(COLOR_RED, COLOR_DEFAULT, 0);
+		emit("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), ptr, format_callsite(entry->site));
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_STACKS
+		emit_stack(entry);
+#endif
+	}
+	else
+	{
+		set_color(COLOR_CYAN, COLOR_DEFAULT, 0);
+		emit("| -> %-7s %6s @%-18p at %-25s   |\n", entry_type_str(entry->type), format_size(entry->size), ptr, format_callsite(entry->site));
+	}
+}
+
+static size_t sum_callsite_counter(checker_status *view, size_t counter_offset)
+{
+	size_t sum = 0;
+
+	for (size_t i = 0; i < view->callsites.capacity; i++)
+	{
+		callsite_stats *site = view->callsites.data[i];
+		if (site != NULL) sum += *(size_t *)((char *)site + counter_offset);
+	}
+
+	return sum;
+}
+static void print_callsite_counter(checker_status *view, char *type_str, size_t counter_offset)
+{
+	set_color(COLOR_RED, COLOR_DEFAULT, 0);
+
+	for (size_t i = 0; i < view->callsites.capacity; i++)
+	{
+		callsite_stats *site = view->callsites.data[i];
+		if (site == NULL) continue;
+
+		size_t count = *(size_t *)((char *)site + counter_offset);
+		if (count != 0)
+			emit("|>>> %-7s x%-25ld at %-25s<<<|\n", type_str, count, format_callsite(site));
+	}
+}
+static void count_lost_blocks(checker_status *view, size_t *block_count, size_t *total_size)
+{
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_COUNTERS
+	//Frees are not matched to blocks, so this is only an estimate
+	size_t allocs = sum_callsite_counter(view, offsetof(callsite_stats, allocs));
+	size_t frees = sum_callsite_counter(view, offsetof(callsite_stats, frees));
+	*block_count = allocs > frees ? allocs - frees : 0;
+	*total_size = 0;
+#elif ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+	*block_count = view->live.count;
+	*total_size = view->live_bytes;
+#else
+	size_t blockc = 0;
+	size_t size = 0;
+
+	//Skip id=0 (NULL/invalid)
+	for (size_t i = 1; i < view->entry_lookup->count; i++)
+	{
+		voidptr_array *entries = view->entry_lookup->data[i];
+		if (!is_block_lost(entries)) continue;
+
+		memory_entry *last = entries->data[entries->count - 1];
+		blockc++;
+		size += last->size;
+	}
+
+	*block_count = blockc;
+	*total_size = size;
+#endif
+}
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+static void print_live_blocks(checker_status *view)
+{
+	set_color(COLOR_RED, COLOR_DEFAULT, 0);
+
+	//The live state has no report order, only snapshots do
+	size_t count = view->lost_order != NULL ? view->lost_count : view->live.capacity;
+	for (size_t i = 0; i < count; i++)
+	{
+		live_block *block = &view->live.data[view->lost_order != NULL ? view->lost_order[i] : i];
+		if (block->ptr == NULL) continue;
+
+		emit("|>>> #%-6ld %6s @%-18p at %-25s<<<|\n", block->id, format_size(block->size), block->ptr, format_callsite(block->site));
+	}
+}
+#endif
+static void print_missing_frees(checker_status *view, size_t block_count)
+{
+	if (block_count == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No missing frees.                                                    |\n");
+		return;
+	}
+
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_COUNTERS
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| Blocks are not tracked at counters level, allocs and frees differ.   |\n");
+	print_callsite_counter(view, "ALLOC", offsetof(callsite_stats, allocs));
+#elif ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+	print_live_blocks(view);
+#else
+	size_t count = view->lost_order != NULL ? view->lost_count : view->entry_lookup->count - 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		voidptr_array *entries = view->entry_lookup->data[view->lost_order != NULL ? view->lost_order[i] : i + 1];
+		if (!is_block_lost(entries)) continue;
+
+		memory_entry *entry = entries->data[entries->count - 1];
+
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld: %-6s, has %-5ld entries:                              |\n", block_id(entries), format_size(entry->size), entries->count);
+
+		for (size_t j = 0; j < entries->count; j++)
+		{
+			entry = entries->data[j];
+			emit_entry(entry, entry->new_ptr, 1);
+		}
+	}
+#endif
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+static void count_zero_re_allocs(checker_status *view, size_t *zero_alloc_count, size_t *zero_realloc_count)
+{
+	size_t allocc = 0, reallocc = 0;
+
+	for (size_t i = 1; i < view->entry_lookup->count; i++)
+	{
+		int type = zero_op_type(view->entry_lookup->data[i]);
+
+		if (type == ENTRY_MALLOC) allocc++;
+		else if (type == ENTRY_REALLOC) reallocc++;
+	}
+
+	*zero_alloc_count = allocc;
+	*zero_realloc_count = reallocc;
+}
+static void print_zero_ops(checker_status *view, int type, size_t count)
+{
+	for (size_t i = 1; i < view->entry_lookup->count && count != 0; i++)
+	{
+		voidptr_array *entries = view->entry_lookup->data[i];
+		if (zero_op_type(entries) != type) continue;
+		count--;
+
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld has %-5ld entries:                                       |\n", block_id(entries), entries->count);
+
+		for (size_t j = 0; j < entries->count; j++)
+		{
+			memory_entry *entry = entries->data[j];
+
+			if (type == ENTRY_MALLOC && (entry->type == ENTRY_MALLOC || entry->type == ENTRY_CALLOC) && entry->size == 0)
+				emit_entry(entry, entry->new_ptr, 1);
+			else if (type == ENTRY_REALLOC && entry->type == ENTRY_REALLOC && entry->size == 0)
+				emit_entry(entry, entry->old_ptr, 1);
+			else
+				emit_entry(entry, entry->new_ptr, 0);
+		}
+	}
+}
+static void print_zero_allocs(checker_status *view, size_t zero_alloc_count)
+{
+	if (zero_alloc_count == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No zero-sized allocs.                                                |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===Zero-sized allocs===                                              |\n");
+	print_zero_ops(view, ENTRY_MALLOC, zero_alloc_count);
+}
+static void print_zero_reallocs(checker_status *view, size_t zero_realloc_count)
+{
+	if (zero_realloc_count == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No zero-sized reallocs.                                              |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===Zero-sized reallocs===                                            |\n");
+	print_zero_ops(view, ENTRY_REALLOC, zero_realloc_count);
+}
+#endif
+
+static void print_null_sample(checker_status *view, int kind)
+{
+	voidptr_array *sample = view->null_samples[kind];
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| Sampled %-5ld of %-10ld entries:                                 |\n", sample->count, view->null_seen[kind]);
+
+	for (size_t i = 0; i < sample->count; i++)
+	{
+		memory_entry *entry = sample->data[i];
+		emit_entry(entry, entry->old_ptr, 0);
+	}
+}
+
+static void count_failed_re_allocs(checker_status *view, size_t *failed_allocs, size_t *failed_reallocs)
+{
+	*failed_allocs = sum_callsite_counter(view, offsetof(callsite_stats, failed_allocs));
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	//REMINDER: Ignore zero-sized ops that return NULL, shown separately
+	size_t reallocc = 0;
+
+	for (size_t i = 1; i < view->entry_lookup->count; i++)
+	{
+		if (has_failed_realloc(view->entry_lookup->data[i])) reallocc++;
+	}
+
+	*failed_reallocs = reallocc;
+#else
+	*failed_reallocs = sum_callsite_counter(view, offsetof(callsite_stats, failed_reallocs));
+#endif
+}
+static void print_failed_allocs(checker_status *view, size_t failed_allocs)
+{
+	if (failed_allocs == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No failed allocs.                                                    |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===Failed allocs===                                                  |\n");
+
+	print_callsite_counter(view, "ALLOC", offsetof(callsite_stats, failed_allocs));
+	print_null_sample(view, NULL_OP_ALLOC);
+}
+static void print_failed_reallocs(checker_status *view, size_t failed_reallocs)
+{
+	if (failed_reallocs == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No failed reallocs.                                                  |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===Failed reallocs===                                                |\n");
+
+#if ALLOC_CHECK_LEVEL < ALLOC_CHECK_LEVEL_FULL
+	print_callsite_counter(view, "REALLOC", offsetof(callsite_stats, failed_reallocs));
+#else
+	for (size_t i = 1; i < view->entry_lookup->count; i++)
+	{
+		voidptr_array *entries = view->entry_lookup->data[i];
+		if (!has_failed_realloc(entries)) continue;
+
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld has %-5ld entries:                                       |\n", block_id(entries), entries->count);
+
+		for (size_t j = 0; j < entries->count; j++)
+		{
+			memory_entry *entry = entries->data[j];
+
+			if (is_failed_realloc(entry))
+				emit_entry(entry, entry->old_ptr, 1);
+			else
+				emit_entry(entry, entry->new_ptr, 0);
+		}
+	}
+#endif
+}
+
+static void print_large_allocs(checker_status *view, size_t large_allocs)
+{
+	if (large_allocs == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No allocations above the mmap threshold.                             |\n");
+		return;
+	}
+
+	for (size_t i = 0; i < view->callsites.capacity; i++)
+	{
+		callsite_stats *site = view->callsites.data[i];
+		if (site == NULL || site->large_allocs == 0) continue;
+
+		//Repeated ones are the syscall storms, single ones are usually fine
+		set_color(site->large_allocs > 1 ? COLOR_RED : COLOR_CYAN, COLOR_DEFAULT, 0);
+		emit("|>>> x%-8ld ~%-6s", site->large_allocs, format_size(site->large_bytes));
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		emit(" freed x%-8ld  at %-25s<<<|\n", site->large_frees, format_callsite(site));
+#else
+		emit("                  at %-25s<<<|\n", format_callsite(site));
+#endif
+	}
+}
+
+static void print_alignments(checker_status *view, size_t line_splits, size_t simd_misaligned)
+{
+	if (line_splits == 0 && simd_misaligned == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No cache line splits or SIMD misaligned blocks.                      |\n");
+		return;
+	}
+
+	for (size_t i = 0; i < view->callsites.capacity; i++)
+	{
+		callsite_stats *site = view->callsites.data[i];
+		if (site == NULL || (site->line_splits == 0 && site->simd_misaligned == 0)) continue;
+
+		set_color(COLOR_RED, COLOR_DEFAULT, 0);
+		emit("|>>> split x%-7ld simd x%-7ld       at %-25s<<<|\n", site->line_splits, site->simd_misaligned, format_callsite(site));
+		set_color(COLOR_CYAN, COLOR_DEFAULT, 0);
+		emit("|    aligned to 16B: %-7ld 32B: %-7ld 64B: %-7ld 128B+: %-7ld  |\n",
+			site->alignments[0], site->alignments[1], site->alignments[2], site->alignments[3]);
+	}
+}
+
+static void print_realloc_moves(checker_status *view, size_t reallocs_moved)
+{
+	if (reallocs_moved == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No reallocs moved their block.                                       |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| Moved/total reallocs of live blocks, and bytes copied by the moves:  |\n");
+
+	for (size_t i = 0; i < view->callsites.capacity; i++)
+	{
+		callsite_stats *site = view->callsites.data[i];
+		if (site == NULL || site->reallocs_moved == 0) continue;
+
+		//Mostly moving sites are the ones that would gain from reserving capacity
+		set_color(site->reallocs_moved * 2 > site->reallocs_moved + site->reallocs_in_place ? COLOR_RED : COLOR_CYAN, COLOR_DEFAULT, 0);
+		emit("|>>> x%-7ld/%-7ld ~%-6s copied    at %-25s<<<|\n", site->reallocs_moved, site->reallocs_moved + site->reallocs_in_place,
+			format_size(site->realloc_copied_bytes), format_callsite(site));
+	}
+}
+
+static void count_null_reallocs_frees(checker_status *view, size_t *null_reallocs, size_t *null_frees, size_t *invalid_frees)
+{
+	*null_reallocs = sum_callsite_counter(view, offsetof(callsite_stats, null_reallocs));
+	*null_frees = sum_callsite_counter(view, offsetof(callsite_stats, null_frees));
+	*invalid_frees = sum_callsite_counter(view, offsetof(callsite_stats, invalid_frees));
+}
+static void print_null_reallocs(checker_status *view, size_t null_reallocs)
+{
+	if (null_reallocs == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No NULL reallocs.                                                    |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===NULL reallocs===                                                  |\n");
+
+	print_callsite_counter(view, "REALLOC", offsetof(callsite_stats, null_reallocs));
+	print_null_sample(view, NULL_OP_REALLOC);
+}
+static void print_null_frees(checker_status *view, size_t null_frees)
+{
+	if (null_frees == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No NULL frees.                                                       |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===NULL frees===                                                     |\n");
+
+	print_callsite_counter(view, "FREE", offsetof(callsite_stats, null_frees));
+	print_null_sample(view, NULL_OP_FREE);
+}
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+static void print_invalid_frees(checker_status *view, size_t invalid_frees)
+{
+	if (invalid_frees == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No invalid or double frees.                                          |\n");
+		return;
+	}
+
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| ===Invalid or double frees===                                        |\n");
+
+	print_callsite_counter(view, "FREE", offsetof(callsite_stats, invalid_frees));
+}
+#endif
+
+static void print_pools(checker_status *view)
+{
+	if (view->pools == NULL)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| All pools were destroyed.                                            |\n");
+		return;
+	}
+
+	//Read without the lock when reporting from the live state, counters may be slightly behind
+	for (chkd_pool *pool = view->pools; pool != NULL; pool = pool->next)
+	{
+		size_t allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+		size_t used_bytes = __atomic_load_n(&pool->used_bytes, __ATOMIC_RELAXED);
+		size_t reserved_bytes = __atomic_load_n(&pool->reserved_bytes, __ATOMIC_RELAXED);
+		size_t failed_allocs = __atomic_load_n(&pool->failed_allocs, __ATOMIC_RELAXED);
+
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Pool %-20.20s x%-8ld blocks, ~%-6s", pool->name, allocs, format_size(used_bytes));
+		emit(" used of ~%-6s   |\n", format_size(reserved_bytes));
+		if (failed_allocs != 0) emit("|    x%-8ld failed allocs                                           |\n", failed_allocs);
+		set_color(COLOR_RED, COLOR_DEFAULT, 0);
+		emit("|>>> created at %-25s                           <<<|\n", format_file_line(pool->file_name, pool->line));
+	}
+}
+
+static void print_arenas(checker_status *view)
+{
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+
+	//Chunks of arenas never destroyed are also listed as missing frees
+	for (chkd_arena *arena = view->arenas; arena != NULL; arena = arena->next)
+	{
+		size_t allocs = __atomic_load_n(&arena->allocs, __ATOMIC_RELAXED);
+		size_t used_bytes = __atomic_load_n(&arena->used_bytes, __ATOMIC_RELAXED);
+		size_t wasted_bytes = __atomic_load_n(&arena->wasted_bytes, __ATOMIC_RELAXED);
+		size_t peak_bytes = __atomic_load_n(&arena->peak_bytes, __ATOMIC_RELAXED);
+		size_t reserved_bytes = __atomic_load_n(&arena->reserved_bytes, __ATOMIC_RELAXED);
+		size_t resets = __atomic_load_n(&arena->resets, __ATOMIC_RELAXED);
+		size_t failed_allocs = __atomic_load_n(&arena->failed_allocs, __ATOMIC_RELAXED);
+
+		emit("|Arena %-20.20s at %-25s resets %-7ld|\n", arena->name, format_file_line(arena->file_name, arena->line), resets);
+		emit("|    x%-8ld used ~%-6s", allocs, format_size(used_bytes));
+		emit(" peak ~%-6s", format_size(peak_bytes));
+		emit(" wasted ~%-6s", format_size(wasted_bytes));
+		emit(" held ~%-6s   |\n", format_size(reserved_bytes));
+		if (failed_allocs != 0) emit("|    x%-8ld failed allocs                                           |\n", failed_allocs);
+	}
+}
+
+static void print_types(checker_status *view)
+{
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+
+	for (type_stats *type = view->types; type != NULL; type = type->next)
+	{
+		emit("|Type %-24.24s %6ldB x%-8ld objects %-9ld     |\n", type->name, type->size, type->allocs, type->objects);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		emit("|    live x%-8ld ~%-6s", type->live_blocks, format_size(type->live_bytes));
+		emit(" peak ~%-6s", format_size(type->peak_bytes));
+		emit(" allocated ~%-6s             |\n", format_size(type->alloc_bytes));
+#else
+		emit("|    allocated ~%-6s                                                 |\n", format_size(type->alloc_bytes));
+#endif
+
+		//Array lengths, by the bucket's lower bound
+		if (type->objects == type->allocs) continue;
+		size_t *lengths = type->lengths;
+		emit("|    len 1:%-5ld 2:%-5ld 4:%-5ld 16:%-5ld 64:%-5ld 256:%-5ld 1k:%-5ld  |\n",
+			lengths[0], lengths[1], lengths[2], lengths[3], lengths[4], lengths[5], lengths[6]);
+	}
+}
+
+#if ALLOC_CHECK_THREAD_SAFE
+static void count_cross_thread_frees(checker_status *view, size_t *frees, size_t *cross_frees)
+{
+	size_t freec = 0, crossc = 0;
+
+	for (int i = 0; i < view->thread_count; i++)
+	{
+		freec += view->threads[i].frees;
+		crossc += view->threads[i].cross_frees;
+	}
+
+	*frees = freec;
+	*cross_frees = crossc;
+}
+static void print_threads(checker_status *view)
+{
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+
+	//The last slot may be shared, its tid is the first thread that used it
+	for (int i = 0; i < view->thread_count; i++)
+	{
+		thread_stats *thread = &view->threads[i];
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		size_t share = thread->frees != 0 ? thread->cross_frees * 100 / thread->frees : 0;
+		emit("|Thread %-3d tid %-7d allocs %-7ld/~%-6s", i, (int)thread->tid, thread->allocs, format_size(thread->alloc_bytes));
+		emit(" frees %-7ld cross %3ld%%|\n", thread->frees, share);
+#else
+		emit("|Thread %-3d tid %-7d allocs %-7ld/~%-6s", i, (int)thread->tid, thread->allocs, format_size(thread->alloc_bytes));
+		emit(" frees %-7ld           |\n", thread->frees);
+#endif
+	}
+}
+#endif
+
+
+
+//===Report filters===
+//Checked while the snapshot is taken, anything left out is never copied nor formatted
+static report_filter filter = { .active = 0 };
+
+int set_alloc_check_report_filter(char *file_glob, int first_line, int last_line, size_t min_size, char *tag)
+{
+	if (last_line != 0 && last_line < first_line) return -1;
+	if (file_glob != NULL && strlen(file_glob) >= FILTER_TEXT_LEN) return -1;
+	if (tag != NULL && strlen(tag) >= FILTER_TEXT_LEN) return -1;
+
+	LOCK(status_lock);
+	snprintf(filter.file_glob, FILTER_TEXT_LEN, "%s", file_glob != NULL ? file_glob : "");
+	snprintf(filter.tag, FILTER_TEXT_LEN, "%s", tag != NULL ? tag : "");
+	filter.first_line = first_line;
+	filter.last_line = last_line;
+	filter.min_size = min_size;
+	filter.active = filter.file_glob[0] != '\0' || last_line != 0 || min_size != 0 || filter.tag[0] != '\0';
+	UNLOCK(status_lock);
+
+	return 0;
+}
+
+//'*' matches any run of characters, '/' included, '?' any one character
+static char glob_match(const char *pattern, const char *text)
+{
+	const char *star = NULL, *resume = NULL;
+
+	while (*text != '\0')
+	{
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			resume = text;
+		}
+		else if (*pattern == '?' || *pattern == *text)
+		{
+			pattern++;
+			text++;
+		}
+		else if (star != NULL)
+		{
+			pattern = star + 1;
+			text = ++resume;
+		}
+		else
+			return 0;
+	}
+
+	while (*pattern == '*') pattern++;
+	return *pattern == '\0';
+}
+
+//Return addresses have no file name, they never match a file or line filter
+static char is_location_in_filter(char *file_name, int line)
+{
+	if (filter.file_glob[0] != '\0' && (line == CHKD_RETURN_ADDRESS_LINE || !glob_match(filter.file_glob, file_name))) return 0;
+	if (filter.last_line != 0 && (line < filter.first_line || line > filter.last_line)) return 0;
+	return 1;
+}
+
+static char is_callsite_in_filter(callsite_stats *site)
+{
+	if (!filter.active) return 1;
+	if (filter.tag[0] != '\0' && (site->type == NULL || strcmp(site->type->name, filter.tag) != 0)) return 0;
+	return is_location_in_filter(site->file_name, site->line);
+}
+
+//Must hold status_lock, while a snapshot is taken: callsites left out by the filter were not copied
+static char is_copied_callsite(callsite_stats *site)
+{
+	return site->copy != NULL;
+}
+
+//Must hold status_lock, while a snapshot is taken: what copied blocks and entries point at, so they are
+//ordered by the copy's rank once unlocked, sites left out by the filter are only read for their name
+static callsite_stats *snapshot_callsite(callsite_stats *site)
+{
+	return site->copy != NULL ? site->copy : site;
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//By the callsite that allocated the block and its size before any free, same as is_copied_callsite
+static char is_block_in_filter(voidptr_array *entries)
+{
+	if (!filter.active) return 1;
+
+	memory_entry *first = entries->data[0];
+	size_t size = first->size;
+	for (size_t j = entries->count; j-- > 0;)
+	{
+		memory_entry *entry = entries->data[j];
+		if (entry->type == ENTRY_FREE) continue;
+		size = entry->size;
+		break;
+	}
+
+	return size >= filter.min_size && is_copied_callsite(first->site);
+}
+#endif
+
+
+
+//===Report snapshots===
+//Frozen copy of everything the report reads, taken while holding the lock
+//Only blocks that show up in the report are copied, the rest of the run is never touched again
+typedef struct
+{
+	char *data;
+	size_t length;
+	size_t used;
+} report_scratch;
+
+//NULL once the mapping is used up, which only happens if its size was estimated wrong
+static void *scratch_alloc(report_scratch *scratch, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (size > scratch->length - scratch->used) return NULL;
+
+	void *ptr = scratch->data + scratch->used;
+	scratch->used += size;
+	return ptr;
+}
+
+static voidptr_array *scratch_voidptr_array(report_scratch *scratch, size_t capacity)
+{
+	voidptr_array *arr = scratch_alloc(scratch, sizeof(voidptr_array));
+	if (arr == NULL) return NULL;
+	arr->data = scratch_alloc(scratch, capacity * sizeof(void *));
+	if (arr->data == NULL) return NULL;
+	arr->capacity = capacity;
+	arr->count = 0;
+	return arr;
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//Returns 0 if the entries did not fit
+static char scratch_copy_entries(report_scratch *scratch, voidptr_array *dest, voidptr_array *src)
+{
+	for (size_t i = 0; i < src->count; i++)
+	{
+		memory_entry *entry = scratch_alloc(scratch, sizeof(memory_entry));
+		if (entry == NULL) return 0;
+		*entry = *(memory_entry *)src->data[i];
+		entry->site = snapshot_callsite(entry->site);
+		dest->data[dest->count++] = entry;
+	}
+
+	return 1;
+}
+
+//Returns 0 if the history did not fit
+static char scratch_copy_history(checker_status *snapshot, report_scratch *scratch, voidptr_array *entries)
+{
+	if (!is_block_in_filter(entries)) return 1;
+
+	voidptr_array *copy = scratch_voidptr_array(scratch, entries->count);
+	if (copy == NULL || snapshot->entry_lookup->count == snapshot->entry_lookup->capacity) return 0;
+	if (!scratch_copy_entries(scratch, copy, entries)) return 0;
+
+	snapshot->entry_lookup->data[snapshot->entry_lookup->count++] = copy;
+	return 1;
+}
+#endif
+
+//A copy that does not fit the mapping drops the whole snapshot, the report falls back to the live state
+#define SCRATCH_CHECK(ptr) do { if ((ptr) == NULL) { munmap(scratch->data, scratch->length); return 0; } } while (0)
+
+//Must hold status_lock, returns 0 if no memory could be mapped for the copy
+static int take_report_snapshot(checker_status *snapshot, report_scratch *scratch)
+{
+	size_t blocks = 0, entries = 0, samples = 0, live_length = 0;
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	//Live blocks and kept histories are the ones the report shows, counted as they are recorded
+	blocks = status.live.count + status.kept->count;
+	entries = status.live_entries + status.kept_entries;
+#elif ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+	//Without histories, the live index is what shows missing frees
+	live_length = status.live.count * sizeof(live_block);
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY && ALLOC_CHECK_THREAD_SAFE
+	//False sharing needs the live blocks too, with room to sort them once unlocked
+	if (status.thread_count > 1) live_length = 2 * status.live.count * sizeof(live_block);
+#endif
+
+	for (int i = 0; i < NULL_OP_COUNT; i++)
+		samples += status.null_samples[i]->count;
+
+	//Keys, sort buffers and positions to order lost blocks and callsites with, filled once unlocked
+	size_t orderable = blocks + status.callsites.count;
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+	orderable += status.live.count;
+#elif ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	orderable += blocks; //Histories are put back in id order first
+#endif
+	size_t order_length = 3 * orderable * sizeof(uint64_t) + 256;
+
+	size_t length = (blocks + 1 + NULL_OP_COUNT) * (sizeof(voidptr_array) + 16) + (blocks + 1) * sizeof(void *) +
+		(entries + samples) * (sizeof(void *) + sizeof(memory_entry) + 16) +
+		status.callsites.count * (sizeof(void *) + sizeof(callsite_stats) + 16) + status.pool_count * (sizeof(chkd_pool) + 16) +
+		status.arena_count * (sizeof(chkd_arena) + 16) + status.type_count * (sizeof(type_stats) + 16) + live_length + order_length +
+		sizeof(report_filter) + 64;
+
+	//Mapped rather than allocated, so the heap being reported on is left alone
+	void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return 0;
+
+	scratch->data = map;
+	scratch->length = length;
+	scratch->used = 0;
+
+	*snapshot = status;
+
+	//Copied first, so callsite copies can point at them
+	//and whatever is filtered by callsite can tell from the copy being there
+	type_stats **type_tail = &snapshot->types;
+	for (type_stats *type = status.types; type != NULL; type = type->next)
+	{
+		type->copy = NULL;
+		if (filter.tag[0] != '\0' && strcmp(type->name, filter.tag) != 0) continue;
+
+		type_stats *copy = scratch_alloc(scratch, sizeof(type_stats));
+		SCRATCH_CHECK(copy);
+		*copy = *type;
+		copy->next = NULL;
+		type->copy = copy;
+		*type_tail = copy;
+		type_tail = &copy->next;
+	}
+	*type_tail = NULL;
+
+	//Callsite names never change, only their counters need copying
+	snapshot->callsites.data = scratch_alloc(scratch, status.callsites.count * sizeof(void *));
+	SCRATCH_CHECK(snapshot->callsites.data);
+	snapshot->callsites.capacity = status.callsites.count;
+	snapshot->callsites.count = 0;
+	for (size_t i = 0; i < status.callsites.capacity; i++)
+	{
+		if (status.callsites.data[i] == NULL) continue;
+
+		status.callsites.data[i]->copy = NULL;
+		if (!is_callsite_in_filter(status.callsites.data[i])) continue;
+
+		callsite_stats *copy = scratch_alloc(scratch, sizeof(callsite_stats));
+		SCRATCH_CHECK(copy);
+		*copy = *status.callsites.data[i];
+		if (copy->type != NULL) copy->type = copy->type->copy;
+		status.callsites.data[i]->copy = copy;
+		snapshot->callsites.data[snapshot->callsites.count++] = copy;
+	}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	//In hash order, sorted back by id once unlocked
+	snapshot->entry_lookup = scratch_voidptr_array(scratch, blocks + 1);
+	SCRATCH_CHECK(snapshot->entry_lookup);
+	snapshot->entry_lookup->data[snapshot->entry_lookup->count] = scratch_voidptr_array(scratch, 0);
+	SCRATCH_CHECK(snapshot->entry_lookup->data[snapshot->entry_lookup->count++]);
+	for (size_t i = 0, seen = 0; i < status.live.capacity && seen < status.live.count; i++)
+	{
+		live_block *block = &status.live.data[i];
+		if (block->ptr == NULL) continue;
+		seen++;
+
+		if (!scratch_copy_history(snapshot, scratch, block->entries)) SCRATCH_CHECK(NULL);
+	}
+	for (size_t i = 0; i < status.kept->count; i++)
+		if (!scratch_copy_history(snapshot, scratch, status.kept->data[i])) SCRATCH_CHECK(NULL);
+#endif
+
+	for (int i = 0; i < NULL_OP_COUNT; i++)
+	{
+		voidptr_array *sample = status.null_samples[i];
+		snapshot->null_samples[i] = scratch_voidptr_array(scratch, sample->count);
+		SCRATCH_CHECK(snapshot->null_samples[i]);
+
+		for (size_t j = 0; j < sample->count; j++)
+		{
+			memory_entry *entry = sample->data[j];
+			if (!is_copied_callsite(entry->site)) continue;
+
+			memory_entry *copy = scratch_alloc(scratch, sizeof(memory_entry));
+			SCRATCH_CHECK(copy);
+			*copy = *entry;
+			copy->site = snapshot_callsite(entry->site);
+			snapshot->null_samples[i]->data[snapshot->null_samples[i]->count++] = copy;
+		}
+	}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	size_t live = live_length != 0 ? status.live.count : 0, head = 0, seen = 0;
+	snapshot->live.data = scratch_alloc(scratch, live * sizeof(live_block));
+	SCRATCH_CHECK(snapshot->live.data);
+	if (filter.active) snapshot->live_bytes = 0;
+	for (size_t i = 0; i < status.live.capacity && seen < live; i++)
+	{
+		live_block *block = &status.live.data[i];
+		if (block->ptr == NULL) continue;
+		seen++;
+
+		if (!filter.active || (block->size >= filter.min_size && is_copied_callsite(block->site)))
+		{
+			snapshot->live.data[head] = *block;
+			snapshot->live.data[head++].site = snapshot_callsite(block->site);
+			if (filter.active) snapshot->live_bytes += block->size;
 		}
+	}
+	snapshot->live.capacity = head;
+	snapshot->live.count = head;
+#endif
+
+	//Pool counters are written by their owners without the lock
+	//Pools and arenas hold untyped blocks, a tag leaves them all out
+	char untyped = !filter.active || filter.tag[0] == '\0';
+
+	chkd_pool **tail = &snapshot->pools;
+	for (chkd_pool *pool = status.pools; pool != NULL; pool = pool->next)
+	{
+		if (!untyped || !is_location_in_filter(pool->file_name, pool->line)) continue;
+
+		chkd_pool *copy = scratch_alloc(scratch, sizeof(chkd_pool));
+		SCRATCH_CHECK(copy);
+		memcpy(copy->name, pool->name, POOL_NAME_LEN);
+		copy->file_name = pool->file_name;
+		copy->line = pool->line;
+		copy->chunks = NULL;
+		copy->allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+		copy->used_bytes = __atomic_load_n(&pool->used_bytes, __ATOMIC_RELAXED);
+		copy->reserved_bytes = __atomic_load_n(&pool->reserved_bytes, __ATOMIC_RELAXED);
+		copy->failed_allocs = __atomic_load_n(&pool->failed_allocs, __ATOMIC_RELAXED);
+		copy->next = NULL;
+		*tail = copy;
+		tail = &copy->next;
+	}
+	*tail = NULL;
+
+	chkd_arena **arena_tail = &snapshot->arenas;
+	for (chkd_arena *arena = status.arenas; arena != NULL; arena = arena->next)
+	{
+		if (!untyped || !is_location_in_filter(arena->file_name, arena->line)) continue;
+
+		chkd_arena *copy = scratch_alloc(scratch, sizeof(chkd_arena));
+		SCRATCH_CHECK(copy);
+		memcpy(copy->name, arena->name, POOL_NAME_LEN);
+		copy->file_name = arena->file_name;
+		copy->line = arena->line;
+		copy->chunks = NULL;
+		copy->current = NULL;
+		copy->allocs = __atomic_load_n(&arena->allocs, __ATOMIC_RELAXED);
+		copy->failed_allocs = __atomic_load_n(&arena->failed_allocs, __ATOMIC_RELAXED);
+		copy->used_bytes = __atomic_load_n(&arena->used_bytes, __ATOMIC_RELAXED);
+		copy->wasted_bytes = __atomic_load_n(&arena->wasted_bytes, __ATOMIC_RELAXED);
+		copy->peak_bytes = __atomic_load_n(&arena->peak_bytes, __ATOMIC_RELAXED);
+		copy->reserved_bytes = __atomic_load_n(&arena->reserved_bytes, __ATOMIC_RELAXED);
+		copy->resets = __atomic_load_n(&arena->resets, __ATOMIC_RELAXED);
+		copy->next = NULL;
+		*arena_tail = copy;
+		arena_tail = &copy->next;
+	}
+	*arena_tail = NULL;
+
+	if (filter.active)
+	{
+		snapshot->filter = scratch_alloc(scratch, sizeof(report_filter));
+		SCRATCH_CHECK(snapshot->filter);
+		*snapshot->filter = filter;
+	}
+
+	return 1;
+}
+
+//===Report order===
+//Lost blocks and callsites are ordered on the snapshot once it is unlocked, by packed keys:
+//the value sorted on in the high bits and the item's position below, so ties keep their order
+static int report_order = ALLOC_CHECK_ORDER_AGE;
+
+int set_alloc_check_report_order(int order)
+{
+	if (order < ALLOC_CHECK_ORDER_AGE || order > ALLOC_CHECK_ORDER_CALLSITE) return -1;
+
+	LOCK(status_lock);
+	report_order = order;
+	UNLOCK(status_lock);
+
+	return 0;
+}
+
+//LSD radix sort, passes over bytes every key shares are skipped
+static void sort_packed_keys(uint64_t *keys, uint64_t *temp, size_t count)
+{
+	uint64_t *src = keys, *dest = temp;
+
+	for (int shift = 0; shift < 64 && count != 0; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+
+		for (size_t i = 0; i < count; i++)
+			offsets[(src[i] >> shift) & 0xFF]++;
+		if (offsets[(src[0] >> shift) & 0xFF] == count) continue;
+
+		for (size_t i = 0, sum = 0; i < 256; i++)
+		{
+			size_t bucket = offsets[i];
+			offsets[i] = sum;
+			sum += bucket;
+		}
+
+		for (size_t i = 0; i < count; i++)
+			dest[offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+
+		uint64_t *tmp = src;
+		src = dest;
+		dest = tmp;
+	}
+
+	if (src != keys) memcpy(keys, src, count * sizeof(uint64_t));
+}
+
+//Bits needed for positions below 'count'
+static int position_bits(size_t count)
+{
+	int bits = 1;
+	while (bits < 63 && ((uint64_t)1 << bits) < count) bits++;
+	return bits;
+}
+
+//Values that do not fit above the position are clamped
+static uint64_t pack_key(uint64_t value, char descending, size_t position, int bits)
+{
+	uint64_t max = UINT64_MAX >> bits;
+	if (value > max) value = max;
+	if (descending) value = max - value;
+	return value << bits | position;
+}
+
+static int compare_callsite_names(callsite_stats *a, callsite_stats *b)
+{
+	//Return addresses go last, by address
+	if ((a->file_name == NULL) != (b->file_name == NULL)) return a->file_name == NULL ? 1 : -1;
+	if (a->file_name == NULL) return (a->key > b->key) - (a->key < b->key);
+
+	int cmp = strcmp(a->file_name, b->file_name);
+	return cmp != 0 ? cmp : (a->line > b->line) - (a->line < b->line);
+}
+
+//Bottom-up merge sort, names do not pack into keys
+static void sort_callsites_by_name(callsite_stats **sites, callsite_stats **temp, size_t count)
+{
+	callsite_stats **src = sites, **dest = temp;
+
+	for (size_t width = 1; width < count; width <<= 1)
+	{
+		for (size_t start = 0; start < count; start += 2 * width)
+		{
+			size_t mid = start + width < count ? start + width : count;
+			size_t end = start + 2 * width < count ? start + 2 * width : count;
+			size_t i = start, j = mid, k = start;
+
+			while (i < mid && j < end) dest[k++] = compare_callsite_names(src[j], src[i]) < 0 ? src[j++] : src[i++];
+			while (i < mid) dest[k++] = src[i++];
+			while (j < end) dest[k++] = src[j++];
+		}
+
+		callsite_stats **tmp = src;
+		src = dest;
+		dest = tmp;
+	}
+
+	if (src != sites) memcpy(sites, src, count * sizeof(callsite_stats *));
+}
+
+//Most lost blocks or bytes first, or allocated ones below summary level
+static uint64_t callsite_order_value(callsite_stats *site, int order)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	return order == ALLOC_CHECK_ORDER_SIZE ? site->live_bytes : site->live_blocks;
+#else
+	return order == ALLOC_CHECK_ORDER_SIZE ? site->alloc_bytes : site->allocs;
+#endif
+}
+
+//The snapshot's callsite array is compact, it is reordered in place and every callsite list follows it
+//Returns 0 if there was no room to sort in, the table order is kept
+static char order_callsites(checker_status *view, report_scratch *scratch, int order)
+{
+	callsite_stats **sites = view->callsites.data;
+	size_t count = view->callsites.count;
+	callsite_stats **temp = scratch_alloc(scratch, count * sizeof(callsite_stats *));
+	uint64_t *keys = scratch_alloc(scratch, count * sizeof(uint64_t));
+	uint64_t *key_temp = scratch_alloc(scratch, count * sizeof(uint64_t));
+	if (temp == NULL || keys == NULL || key_temp == NULL) return 0;
+
+	if (order == ALLOC_CHECK_ORDER_CALLSITE)
+		sort_callsites_by_name(sites, temp, count);
+	else if (order != ALLOC_CHECK_ORDER_AGE)
+	{
+		int bits = position_bits(count);
+
+		for (size_t i = 0; i < count; i++)
+			keys[i] = pack_key(callsite_order_value(sites[i], order), 1, i, bits);
+		sort_packed_keys(keys, key_temp, count);
+
+		for (size_t i = 0; i < count; i++)
+			temp[i] = sites[keys[i] & (((uint64_t)1 << bits) - 1)];
+		memcpy(sites, temp, count * sizeof(callsite_stats *));
+	}
+
+	for (size_t i = 0; i < count; i++)
+		sites[i]->rank = i;
+
+	return 1;
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+//Lost blocks are grouped by where they were allocated, callsites must be ordered first
+static uint64_t block_order_value(checker_status *view, size_t position, int order)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	voidptr_array *entries = view->entry_lookup->data[position];
+	memory_entry *first = entries->data[0], *last = entries->data[entries->count - 1];
+	size_t id = first->id, size = last->size;
+	callsite_stats *site = first->site;
+#else
+	live_block *block = &view->live.data[position];
+	size_t id = block->id, size = block->size;
+	callsite_stats *site = block->site;
+#endif
+
+	if (order == ALLOC_CHECK_ORDER_AGE) return id;
+	if (order == ALLOC_CHECK_ORDER_SIZE) return size;
+	return site->rank; //Reported blocks point at their callsite's copy, see snapshot_callsite
+}
+
+static void sort_lost_blocks(checker_status *view, size_t *positions, size_t count, int order, uint64_t *keys, uint64_t *temp)
+{
+	int bits = position_bits(count);
+
+	for (size_t i = 0; i < count; i++)
+		keys[i] = pack_key(block_order_value(view, positions[i], order), order == ALLOC_CHECK_ORDER_SIZE, i, bits);
+	sort_packed_keys(keys, temp, count);
+
+	for (size_t i = 0; i < count; i++)
+		temp[i] = positions[keys[i] & (((uint64_t)1 << bits) - 1)];
+	for (size_t i = 0; i < count; i++)
+		positions[i] = temp[i];
+}
+
+static void order_lost_blocks(checker_status *view, report_scratch *scratch, int order)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	size_t count = 0;
+	for (size_t i = 1; i < view->entry_lookup->count; i++)
+		if (is_block_lost(view->entry_lookup->data[i])) count++;
+
+	//Already oldest first
+	size_t *positions = scratch_alloc(scratch, count * sizeof(size_t));
+	if (positions == NULL) return;
+	for (size_t i = 1, head = 0; i < view->entry_lookup->count; i++)
+		if (is_block_lost(view->entry_lookup->data[i])) positions[head++] = i;
+#else
+	size_t count = view->live.count;
+	size_t *positions = scratch_alloc(scratch, count * sizeof(size_t));
+	if (positions == NULL) return;
+	for (size_t i = 0; i < count; i++)
+		positions[i] = i;
+#endif
+
+	//Without room to sort, the lost blocks are listed in the view's own order
+	uint64_t *keys = scratch_alloc(scratch, count * sizeof(uint64_t));
+	uint64_t *temp = scratch_alloc(scratch, count * sizeof(uint64_t));
+	if (keys == NULL || temp == NULL) return;
+
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_SUMMARY
+	//The copied live set is in hash or address order, ties should still come oldest first
+	sort_lost_blocks(view, positions, count, ALLOC_CHECK_ORDER_AGE, keys, temp);
+#endif
+	if (order != ALLOC_CHECK_ORDER_AGE) sort_lost_blocks(view, positions, count, order, keys, temp);
+
+	view->lost_order = positions;
+	view->lost_count = count;
+}
+#endif
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//Histories are copied in live index order, without room to sort they are listed that way
+static void sort_histories_by_id(checker_status *view, report_scratch *scratch)
+{
+	voidptr_array **histories = (voidptr_array **)view->entry_lookup->data + 1;
+	size_t count = view->entry_lookup->count - 1;
+	voidptr_array **temp = scratch_alloc(scratch, count * sizeof(voidptr_array *));
+	uint64_t *keys = scratch_alloc(scratch, count * sizeof(uint64_t));
+	uint64_t *key_temp = scratch_alloc(scratch, count * sizeof(uint64_t));
+	if (temp == NULL || keys == NULL || key_temp == NULL) return;
+
+	int bits = position_bits(count);
+	for (size_t i = 0; i < count; i++)
+		keys[i] = pack_key(block_id(histories[i]), 0, i, bits);
+	sort_packed_keys(keys, key_temp, count);
+
+	for (size_t i = 0; i < count; i++)
+		temp[i] = histories[keys[i] & (((uint64_t)1 << bits) - 1)];
+	memcpy(histories, temp, count * sizeof(voidptr_array *));
+}
+#endif
+
+static void order_report_snapshot(checker_status *view, report_scratch *scratch, int order)
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	sort_histories_by_id(view, scratch);
+#endif
+	//Blocks grouped by callsite need the callsites ranked first
+	if (!order_callsites(view, scratch, order)) return;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	order_lost_blocks(view, scratch, order);
+#endif
+}
+
+
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY && ALLOC_CHECK_THREAD_SAFE
+//===False sharing===
+//Live blocks of different threads within one cache line, found by sorting the snapshot by address
+#define FALSE_SHARING_PAIRS 32
+
+typedef struct
+{
+	callsite_stats *first, *second;
+	size_t count;
+} sharing_pair;
+
+//LSD radix sort, passes over bytes every address shares are skipped
+static void sort_live_by_address(live_block *blocks, live_block *temp, size_t count)
+{
+	live_block *src = blocks, *dest = temp;
+
+	for (int shift = 0; shift < 64 && count != 0; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+
+		for (size_t i = 0; i < count; i++)
+			offsets[((uintptr_t)src[i].ptr >> shift) & 0xFF]++;
+		if (offsets[((uintptr_t)src[0].ptr >> shift) & 0xFF] == count) continue;
+
+		for (size_t i = 0, sum = 0; i < 256; i++)
+		{
+			size_t bucket = offsets[i];
+			offsets[i] = sum;
+			sum += bucket;
+		}
+
+		for (size_t i = 0; i < count; i++)
+			dest[offsets[((uintptr_t)src[i].ptr >> shift) & 0xFF]++] = src[i];
+
+		live_block *tmp = src;
+		src = dest;
+		dest = tmp;
+	}
+
+	if (src != blocks) memcpy(blocks, src, count * sizeof(live_block));
+}
+
+//Must be given a sorted view, returns how many block pairs share a line
+static size_t find_false_sharing(checker_status *view, sharing_pair *pairs, size_t *pair_count)
+{
+	size_t total = 0;
+	*pair_count = 0;
+
+	for (size_t i = 0; i < view->live.count; i++)
+	{
+		live_block *block = &view->live.data[i];
+		uintptr_t last_line = ((uintptr_t)block->ptr + (block->size != 0 ? block->size - 1 : 0)) / ALLOC_CHECK_CACHE_LINE;
+
+		for (size_t j = i + 1; j < view->live.count && (uintptr_t)view->live.data[j].ptr / ALLOC_CHECK_CACHE_LINE <= last_line; j++)
+		{
+			live_block *other = &view->live.data[j];
+			if (other->thread == block->thread) continue;
+			total++;
+
+			//Pairs are unordered, keep the lower callsite first
+			callsite_stats *first = block->site < other->site ? block->site : other->site;
+			callsite_stats *second = block->site < other->site ? other->site : block->site;
+
+			size_t k = 0;
+			while (k < *pair_count && (pairs[k].first != first || pairs[k].second != second)) k++;
+			if (k == FALSE_SHARING_PAIRS) continue; //Only counted in the total
+
+			if (k == *pair_count)
+			{
+				pairs[k].first = first;
+				pairs[k].second = second;
+				pairs[k].count = 0;
+				(*pair_count)++;
+			}
+			pairs[k].count++;
+		}
+	}
+
+	return total;
+}
+
+static void print_false_sharing(checker_status *view)
+{
+	if (!view->live_sorted)
+	{
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("| Not analyzed, there was no memory for a snapshot.                    |\n");
+		return;
+	}
+
+	sharing_pair pairs[FALSE_SHARING_PAIRS];
+	size_t pair_count;
+	size_t total = find_false_sharing(view, pairs, &pair_count);
+
+	if (total == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No live blocks of different threads share a cache line.              |\n");
+		return;
+	}
+
+	set_color(COLOR_RED, COLOR_DEFAULT, 0);
+	for (size_t i = 0; i < pair_count; i++)
+	{
+		total -= pairs[i].count;
+		emit("|>>> x%-6ld %-25s", pairs[i].count, format_callsite(pairs[i].first));
+		emit(" <-> %-25s<<<|\n", format_callsite(pairs[i].second));
+	}
+
+	if (total != 0)
+		emit("|>>> x%-6ld other callsite pairs                                   <<<|\n", total);
+}
+#endif
+
+static void print_report(checker_status *view)
+{
+	//Calculate metrics, no memory is allocated while reporting
+	size_t allocs = view->alloc_count;
+	size_t reallocs = view->realloc_count;
+	size_t frees = view->free_count;
+
+	size_t blocks_lost, memory_lost;
+	count_lost_blocks(view, &blocks_lost, &memory_lost);
+
+	size_t zero_allocs = 0, zero_reallocs = 0;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	count_zero_re_allocs(view, &zero_allocs, &zero_reallocs);
+#endif
+	size_t null_zero_allocs = sum_callsite_counter(view, offsetof(callsite_stats, zero_allocs));
+
+	size_t failed_allocs, failed_reallocs;
+	count_failed_re_allocs(view, &failed_allocs, &failed_reallocs);
+
+	size_t line_splits = sum_callsite_counter(view, offsetof(callsite_stats, line_splits));
+	size_t simd_misaligned = sum_callsite_counter(view, offsetof(callsite_stats, simd_misaligned));
+
+	size_t reallocs_in_place = sum_callsite_counter(view, offsetof(callsite_stats, reallocs_in_place));
+	size_t reallocs_moved = sum_callsite_counter(view, offsetof(callsite_stats, reallocs_moved));
+	size_t realloc_copied_bytes = sum_callsite_counter(view, offsetof(callsite_stats, realloc_copied_bytes));
+
+	size_t large_allocs = sum_callsite_counter(view, offsetof(callsite_stats, large_allocs));
+	size_t large_bytes = sum_callsite_counter(view, offsetof(callsite_stats, large_bytes));
+
+	size_t null_reallocs, null_frees, invalid_frees;
+	count_null_reallocs_frees(view, &null_reallocs, &null_frees, &invalid_frees);
+
+#if ALLOC_CHECK_THREAD_SAFE
+	size_t thread_frees, cross_frees;
+	count_cross_thread_frees(view, &thread_frees, &cross_frees);
+#endif
+
+	//Internally 70 cols wide (72 external)
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("\n\n");
+	emit("+=========================alloc_check report===========================+\n");
+	emit("+--Statistics----------------------------------------------------------+\n");
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("|Total allocs/reallocs/frees: %-5ld/%-5ld/%-5ld                        |\n", allocs, reallocs, frees);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit("|Total blocks/memory lost: %-5ld/~%-6s                               |\n", blocks_lost, format_size(memory_lost));
+	emit("|Peak memory in use: ~%-6s                                           |\n", format_size(view->peak_bytes));
+#else
+	(void)memory_lost;
+	emit("|Total blocks lost (estimate): %-5ld                                   |\n", blocks_lost);
+#endif
+	emit("|Total zero-sized allocs/reallocs: %-5ld/%-5ld                         |\n", zero_allocs + null_zero_allocs, zero_reallocs);
+	emit("|Total failed allocs/reallocs: %-5ld/%-5ld                             |\n", failed_allocs, failed_reallocs);
+	emit("|Total NULL reallocs/frees: %-5ld/%-5ld                                |\n", null_reallocs, null_frees);
+	emit("|Total cache line splits/SIMD misaligned: %-7ld/%-7ld              |\n", line_splits, simd_misaligned);
+	emit("|Total reallocs in place/moved: %-7ld/%-7ld, ~%-6s copied        |\n", reallocs_in_place, reallocs_moved, format_size(realloc_copied_bytes));
+	emit("|Total allocs/memory above %-6s", format_size(large_threshold));
+	emit(": %-5ld/~%-6s                       |\n", large_allocs, format_size(large_bytes));
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit("|Total invalid/double frees: %-5ld                                     |\n", invalid_frees);
+#if ALLOC_CHECK_THREAD_SAFE
+	emit("|Total cross-thread frees/share: %-5ld/%3ld%%                            |\n", cross_frees, thread_frees != 0 ? cross_frees * 100 / thread_frees : 0);
+#endif
+#endif
+	emit("|Total pools created/destroyed: %-5ld/%-5ld                            |\n", view->pools_created, view->pools_destroyed);
+	emit("|Total arenas created/destroyed: %-5ld/%-5ld                           |\n", view->arenas_created, view->arenas_destroyed);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	if (view->spill_lost != 0)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|Total history entries lost to spill write errors: %-10ld          |\n", view->spill_lost);
+	}
+#endif
+	if (view->filter != NULL)
+	{
+		//Operation totals cover the whole run, lost blocks and every list only what matched
+		report_filter *applied = view->filter;
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|Filter file %-26.26s lines %6d-%-6d min ~%-6s|\n", applied->file_glob[0] != '\0' ? applied->file_glob : "*",
+			applied->first_line, applied->last_line, format_size(applied->min_size));
+		emit("|Filter tag %-59.59s|\n", applied->tag[0] != '\0' ? applied->tag : "*");
+	}
+	else if (view == &status && filter.active)
+	{
+		//Only snapshots are filtered, the live state is reported as is
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|Filter not applied, no memory for a snapshot so everything is listed  |\n");
+	}
+	if (meta_pool.used != 0)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|Out of memory, metadata pool used/peak live: %-6s", format_size(meta_pool.used));
+		emit("/%-6s            |\n", format_size(meta_pool.peak_live));
+	}
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Missing frees-------------------------------------------------------+\n");
+	print_missing_frees(view, blocks_lost);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Pools not destroyed-------------------------------------------------+\n");
+	print_pools(view);
+	if (view->arenas != NULL)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("+--Arenas--------------------------------------------------------------+\n");
+		print_arenas(view);
+	}
+	if (view->types != NULL)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("+--Types---------------------------------------------------------------+\n");
+		print_types(view);
+	}
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Invalid operations--------------------------------------------------+\n");
+#if ALLOC_CHECK_LEVEL < ALLOC_CHECK_LEVEL_FULL
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("| Zero-sized blocks are not tracked without histories.                 |\n");
+#else
+	print_zero_allocs(view, zero_allocs);
+	print_zero_reallocs(view, zero_reallocs);
+#endif
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Failed (re)allocations----------------------------------------------+\n");
+	print_failed_allocs(view, failed_allocs);
+	print_failed_reallocs(view, failed_reallocs);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Alignment-----------------------------------------------------------+\n");
+	print_alignments(view, line_splits, simd_misaligned);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Realloc moves-------------------------------------------------------+\n");
+	print_realloc_moves(view, reallocs_moved);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Large allocations (mmap threshold)----------------------------------+\n");
+	print_large_allocs(view, large_allocs);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Possible mistakes---------------------------------------------------+\n");
+	print_null_reallocs(view, null_reallocs);
+	print_null_frees(view, null_frees);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	print_invalid_frees(view, invalid_frees);
+#endif
+#if ALLOC_CHECK_THREAD_SAFE
+	if (view->thread_count > 1)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("+--Threads-------------------------------------------------------------+\n");
+		print_threads(view);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("+--False sharing risks (live blocks)-----------------------------------+\n");
+		print_false_sharing(view);
+#endif
+	}
+#endif
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+======================================================================+\n");
+	set_color(COLOR_DEFAULT, COLOR_DEFAULT, 0);
+}
+
+//Must hold report_lock
+static void write_report(int fd, char color)
+{
+	checker_status snapshot;
+	report_scratch scratch;
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	int order = report_order;
+
+	if (take_report_snapshot(&snapshot, &scratch))
+	{
+		//Other threads keep allocating while the snapshot is formatted
+		UNLOCK(status_lock);
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY && ALLOC_CHECK_THREAD_SAFE
+		//Room for the sort was only reserved with the snapshot when there are other threads
+		if (snapshot.thread_count > 1)
+		{
+			live_block *temp = scratch_alloc(&scratch, snapshot.live.count * sizeof(live_block));
+			if (temp != NULL)
+			{
+				sort_live_by_address(snapshot.live.data, temp, snapshot.live.count);
+				snapshot.live_sorted = 1;
+			}
+		}
+#endif
+		order_report_snapshot(&snapshot, &scratch, order);
+
+		emit_begin(fd, color);
+		print_report(&snapshot);
+		emit_end();
+
+		munmap(scratch.data, scratch.length);
+	}
+	else
+	{
+		//No memory for a copy, report from the live state instead
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+		compact_histories();
+#endif
+		emit_begin(fd, color);
+		print_report(&status);
+		emit_end();
+
+		UNLOCK(status_lock);
+	}
+}
+
+void report_alloc_checks()
+{
+	LOCK(report_lock);
+	write_report(STDOUT_FILENO, 1);
+	UNLOCK(report_lock);
+}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+//Must hold report_lock
+static void write_block_report(size_t id, int fd, char color)
+{
+	memory_entry chunk[64];
+	spill_record spilled = { .id = id, .first = 0, .count = 0 };
+	int file = -1;
+
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
+	emit_begin(fd, color);
+
+	size_t position = id != 0 && id < status.id_counter ? find_history(id) : 0;
+	voidptr_array *entries = status.entry_lookup->data[position];
+
+	if (id == 0 || id >= status.id_counter)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld does not exist.                                          |\n", id);
+	}
+	else if (position != 0 && entries != NULL)
+	{
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld has %-5ld entries (%-5ld from disk):                     |\n", id, entries->count, (size_t)0);
+
+		for (size_t i = 0; i < entries->count; i++)
+		{
+			memory_entry *entry = entries->data[i];
+			emit_entry(entry, entry->type == ENTRY_FREE ? entry->old_ptr : entry->new_ptr, 0);
+		}
+	}
+	else
+	{
+		//Spilled, found through the index and read back once the lock is released
+		spill_record *record = find_spill_record(id);
+		if (record != NULL)
+		{
+			spilled = *record;
+			if (spill_state.buffered != 0) flush_spill_buffer(0);
+			file = dup(spill_state.fd);
+		}
+
+		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+		emit("|Block #%-5ld has %-5ld entries (%-5ld from disk):                     |\n", id, spilled.count, spilled.count);
+	}
+
+	size_t generation = tracker_generation;
+	UNLOCK(status_lock);
+
+	size_t shown = 0;
+	while (file >= 0 && shown < spilled.count)
+	{
+		size_t read = read_spilled_entries(file, spilled.first + shown, spilled.count - shown < 64 ? spilled.count - shown : 64, chunk);
+		if (read == 0) break;
+
+		//Entries point at their callsites, which only live until the next cleanup
+		LOCK(status_lock);
+		char current = generation == tracker_generation;
+		for (size_t j = 0; current && j < read; j++)
+			emit_entry(&chunk[j], chunk[j].type == ENTRY_FREE ? chunk[j].old_ptr : chunk[j].new_ptr, 0);
+		UNLOCK(status_lock);
+
+		if (!current) break;
+		shown += read;
+	}
+	if (file >= 0) close(file);
+
+	if (shown < spilled.count)
+	{
+		set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+		emit("|    %-5ld entries could not be read back.                             |\n", spilled.count - shown);
+	}
+
+	set_color(COLOR_DEFAULT, COLOR_DEFAULT, 0);
+	emit_end();
+}
+
+void report_alloc_check_block(size_t id)
+{
+	LOCK(report_lock);
+	write_block_report(id, STDOUT_FILENO, 1);
+	UNLOCK(report_lock);
+}
+#endif
+
+//Must hold report_lock, the emitter and format buffers are shared with the other reports
+static void write_mmap_report(char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "alloc_check: could not open '%s'.\n", path);
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mmap_header))
+	{
+		fprintf(stderr, "alloc_check: '%s' is not a state file.\n", path);
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "alloc_check: could not map '%s'.\n", path);
+		return;
+	}
+
+	mmap_header *header = map;
+	if (memcmp(header->magic, MMAP_MAGIC, 8) != 0 || header->version != MMAP_VERSION ||
+		header->event_size != sizeof(mmap_event) || header->block_size != sizeof(mmap_block) ||
+		header->block_offset + header->capacity * sizeof(mmap_block) > (uint64_t)st.st_size)
+	{
+		fprintf(stderr, "alloc_check: '%s' is not a compatible state file.\n", path);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	mmap_event *events = (mmap_event *)((char *)map + header->event_offset);
+	mmap_block *blocks = (mmap_block *)((char *)map + header->block_offset);
+	uint64_t first_event = header->event_count > header->capacity ? header->event_count - header->capacity : 0;
+
+	size_t live_blocks = 0, live_memory = 0;
+	for (uint64_t i = 0; i < header->capacity; i++)
+	{
+		if (blocks[i].state != MMAP_BLOCK_LIVE) continue;
+		live_blocks++;
+		live_memory += blocks[i].size;
+	}
+
+	emit_begin(STDOUT_FILENO, 1);
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("\n\n");
+	emit("+======================alloc_check crash report========================+\n");
+	emit("+--Statistics----------------------------------------------------------+\n");
+	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
+	emit("|Process %-8ld ended %-47s|\n", (long)header->pid, header->state == MMAP_STATE_CLEAN ? "cleanly." : "without cleanup (crash?).");
+	emit("|Total events/kept: %-10ld/%-10ld                              |\n", (long)header->event_count, (long)(header->event_count - first_event));
+	emit("|Total blocks/dropped: %-10ld/%-10ld                           |\n", (long)header->block_count, (long)header->dropped_blocks);
+	emit("|Live blocks/memory: %-5ld/~%-6s                                     |\n", live_blocks, format_size(live_memory));
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+--Live blocks---------------------------------------------------------+\n");
 
-		if (!freed)
-		{
-			blockc++;
-			size += last_size;
-		}
+	if (live_blocks == 0)
+	{
+		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
+		emit("| No live blocks.                                                      |\n");
 	}
 
-	blockv = malloc(blockc * sizeof(size_t));
-	DIE_NULL(blockv);
-
-	//Skip id=0 (NULL/invalid)
-	for (size_t i = 1, head = 0; i < status.entry_lookup->count && head < blockc; i++)
+	for (uint64_t i = 0; i < header->capacity; i++)
 	{
-		char freed = 0;
-		voidptr_array *current_block = status.entry_lookup->data[i];
+		mmap_block *block = &blocks[i];
+		if (block->state != MMAP_BLOCK_LIVE) continue;
 
-		for (size_t j = 0; j < current_block->count; j++)
+		set_color(COLOR_RED, COLOR_DEFAULT, 0);
+		if (block->last_event >= first_event)
 		{
-			memory_entry *current_entry = current_block->data[j];
+			mmap_event *event = &events[block->last_event % header->capacity];
+			char address[MMAP_FILE_NAME_LEN];
+			char *where = address;
 
-			if (current_entry->type == ENTRY_FREE)
+			//Addresses from another process can not be resolved here
+			if (event->line == CHKD_RETURN_ADDRESS_LINE)
 			{
-				freed = 1;
-				break; //REVIEW: Break needed? should be last entry
+				void *return_address;
+				memcpy(&return_address, event->file_name, sizeof(return_address));
+				snprintf(address, sizeof(address), "%p", return_address);
 			}
-		}
+			else
+				where = format_file_line(event->file_name, event->line);
 
-		if (!freed)
-		{
-			blockv[head++] = i;
+			emit("|>>> #%-6ld %6s @%-18p at %-25s<<<|\n", (long)block->id, format_size(block->size), (void *)(uintptr_t)block->ptr, where);
 		}
+		else
+			emit("|>>> #%-6ld %6s @%-18p at %-25s<<<|\n", (long)block->id, format_size(block->size), (void *)(uintptr_t)block->ptr, "(event overwritten)");
 	}
 
-	*block_array = blockv;
-	*block_count = blockc;
-	*total_size = size;
+	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
+	emit("+======================================================================+\n");
+	set_color(COLOR_DEFAULT, COLOR_DEFAULT, 0);
+	emit_end();
+
+	munmap(map, st.st_size);
+}
+
+void report_alloc_check_mmap(char *path)
+{
+	LOCK(report_lock);
+	write_mmap_report(path);
+	UNLOCK(report_lock);
 }
-static void print_missing_frees(size_t *block_array, size_t block_count)
+
+void reset_alloc_check_counters()
 {
-	if (block_count == 0)
+	LOCK(status_lock);
+
+	if (status.callsites.data == NULL)
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No missing frees.                                                    |\n");
+		UNLOCK(status_lock);
 		return;
 	}
 
-	for (size_t i = 0; i < block_count; i++)
+	drain_async_queues(SIZE_MAX);
+
+	for (size_t i = 0; i < status.callsites.capacity; i++)
 	{
-		size_t block = block_array[i];
-		voidptr_array *entries = status.entry_lookup->data[block];
-		memory_entry *entry = entries->data[entries->count - 1];
+		callsite_stats *site = status.callsites.data[i];
+		if (site == NULL) continue;
+
+		//Counters start at allocs, live ones are restored since their blocks may still be freed
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		size_t live_blocks = site->live_blocks, live_bytes = site->live_bytes;
+#endif
+		memset(&site->allocs, 0, sizeof(callsite_stats) - offsetof(callsite_stats, allocs));
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		site->live_blocks = live_blocks;
+		site->live_bytes = live_bytes;
+#endif
+	}
 
-		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-		printf("|Block #%-5ld: %-6s, has %-5ld entries:                              |\n", block, format_size(entry->size), entries->count);
+	for (type_stats *type = status.types; type != NULL; type = type->next)
+	{
+		type->allocs = 0;
+		type->objects = 0;
+		type->alloc_bytes = 0;
+		memset(type->lengths, 0, sizeof(type->lengths));
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		type->peak_bytes = type->live_bytes;
+#endif
+	}
 
-		set_color(COLOR_RED, COLOR_DEFAULT, 0);
-		for (size_t j = 0; j < entries->count; j++)
-		{
-			entry = entries->data[j];
-			printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
-		}
+	for (int i = 0; i < NULL_OP_COUNT; i++)
+	{
+		voidptr_array *sample = status.null_samples[i];
+
+		for (size_t j = 0; j < sample->count; j++)
+			destroy_memory_entry(sample->data[j]);
+
+		sample->count = 0;
+		status.null_seen[i] = 0;
+	}
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	status.peak_bytes = status.live_bytes;
+#endif
+
+#if ALLOC_CHECK_THREAD_SAFE
+	for (int i = 0; i < status.thread_count; i++)
+	{
+		pid_t tid = status.threads[i].tid;
+		memset(&status.threads[i], 0, sizeof(thread_stats));
+		status.threads[i].tid = tid;
 	}
+#endif
+
+	status.alloc_count = 0;
+	status.realloc_count = 0;
+	status.free_count = 0;
+	status.alloc_bytes = 0;
+	status.pools_created = status.pool_count;
+	status.pools_destroyed = 0;
+	status.arenas_created = status.arena_count;
+	status.arenas_destroyed = 0;
+
+	shm_state.until_refresh = 0;
+	publish_shm();
+
+	UNLOCK(status_lock);
 }
 
-static void find_zero_re_allocs(size_t **alloc_array, size_t **realloc_array, size_t *zero_alloc_count, size_t *zero_realloc_count)
+#if ALLOC_CHECK_THREAD_SAFE
+//===Control socket===
+//Background thread serving one command per connection, replies go back through the emitter without colors
+#define CONTROL_COMMAND_SIZE 256
+#define CONTROL_TIMEOUT_S 5
+
+static struct
 {
-	size_t *allocv = NULL, *reallocv = NULL;
-	size_t allocc = 0, reallocc = 0;
+	int fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	pthread_t thread;
+} control = { .fd = -1 };
 
-	for (size_t i = 0; i < status.entry_lookup->count; i++)
-	{
-		voidptr_array *current_block = status.entry_lookup->data[i];
+static void control_reply(int fd, const char *message)
+{
+	emit_begin(fd, 0);
+	emit("%s", message);
+	emit_end();
+}
 
-		for (size_t j = 0; j < current_block->count; j++)
-		{
-			memory_entry *current_entry = current_block->data[j];
+//Totals, per-callsite and per-type counters, copied under status_lock so they can be formatted without it
+typedef struct
+{
+	checker_status totals; //Only its counters, the pointers are not valid outside the lock
+	callsite_stats **sites;
+	size_t count;
+	type_stats *types;
+	size_t type_count;
+	void *data;
+	size_t length;
+} counters_copy;
+
+//Returns 0 if no memory could be mapped for the copy
+static int copy_counters(counters_copy *copy)
+{
+	LOCK(status_lock);
+	init_checker();
+	drain_async_queues(SIZE_MAX);
 
-			if ((current_entry->type == ENTRY_MALLOC || current_entry->type == ENTRY_CALLOC) && current_entry->size == 0)
-			{
-				allocc++;
-				break;
-			}
-			else if (current_entry->type == ENTRY_REALLOC && current_entry->size == 0)
-			{
-				reallocc++;
-				break;
-			}
-		}
+	copy->count = status.callsites.count;
+	copy->type_count = status.type_count;
+	copy->length = copy->count * (sizeof(void *) + sizeof(callsite_stats)) + copy->type_count * sizeof(type_stats) + 1;
+	copy->data = mmap(NULL, copy->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy->data == MAP_FAILED)
+	{
+		UNLOCK(status_lock);
+		return 0;
 	}
 
-	allocv = malloc(allocc * sizeof(size_t));
-	DIE_NULL(allocv);
-	reallocv = malloc(reallocc * sizeof(size_t));
-	DIE_NULL(reallocv);
-
-	for (size_t i = 0, ahead = 0, rhead = 0; i < status.entry_lookup->count && (ahead < allocc || rhead < reallocc); i++)
+	copy->totals = status;
+	copy->sites = copy->data;
+	callsite_stats *sites = (callsite_stats *)(copy->sites + copy->count);
+	for (size_t i = 0, head = 0; i < status.callsites.capacity && head < copy->count; i++)
 	{
-		voidptr_array *current_block = status.entry_lookup->data[i];
+		if (status.callsites.data[i] == NULL) continue;
 
-		for (size_t j = 0; j < current_block->count; j++)
-		{
-			memory_entry *current_entry = current_block->data[j];
+		sites[head] = *status.callsites.data[i];
+		copy->sites[head] = &sites[head];
+		head++;
+	}
 
-			if ((current_entry->type == ENTRY_MALLOC || current_entry->type == ENTRY_CALLOC) && current_entry->size == 0)
-			{
-				allocv[ahead++] = i;
-				break;
-			}
-			else if (current_entry->type == ENTRY_REALLOC && current_entry->size == 0)
-			{
-				reallocv[rhead++] = i;
-				break;
-			}
-		}
+	//Names are the descriptors' string literals, valid without the lock
+	copy->types = (type_stats *)(sites + copy->count);
+	size_t head = 0;
+	for (type_stats *type = status.types; type != NULL && head < copy->type_count; type = type->next)
+	{
+		copy->types[head] = *type;
+		copy->types[head].next = NULL;
+		copy->types[head].copy = NULL;
+		head++;
 	}
+	copy->type_count = head;
 
-	*alloc_array = allocv;
-	*realloc_array = reallocv;
-	*zero_alloc_count = allocc;
-	*zero_realloc_count = reallocc;
+	UNLOCK(status_lock);
+	return 1;
 }
-static void print_zero_allocs(size_t *block_array, size_t zero_alloc_count)
+
+//Must hold report_lock
+static void write_callsite_snapshot(int fd)
 {
-	if (zero_alloc_count == 0)
+	counters_copy copy;
+	if (!copy_counters(&copy))
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No zero-sized allocs.                                                |\n");
+		control_reply(fd, "error: no memory for a snapshot\n");
 		return;
 	}
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===Zero-sized allocs===                                              |\n");
-
-	for (size_t i = 0; i < zero_alloc_count; i++)
+	checker_status *totals = &copy.totals;
+	emit_begin(fd, 0);
+	emit("allocs\t%lu\nreallocs\t%lu\nfrees\t%lu\nalloc_bytes\t%lu\n", totals->alloc_count, totals->realloc_count,
+		totals->free_count, totals->alloc_bytes);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit("live_blocks\t%lu\nlive_bytes\t%lu\npeak_bytes\t%lu\n", totals->live.count, totals->live_bytes, totals->peak_bytes);
+	emit("\ncallsite\tallocs\talloc_bytes\tfrees\tlive_blocks\tlive_bytes\n");
+#else
+	emit("\ncallsite\tallocs\talloc_bytes\tfrees\n");
+#endif
+
+	for (size_t i = 0; i < copy.count; i++)
 	{
-		size_t block = block_array[i];
-		voidptr_array *entries = status.entry_lookup->data[block];
-		memory_entry *entry;
+		callsite_stats *site = copy.sites[i];
+
+		if (site->line == CHKD_RETURN_ADDRESS_LINE)
+			emit("%s", format_address(site->key, 45));
+		else
+			emit("%s:%d", site->file_name, site->line);
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+		emit("\t%lu\t%lu\t%lu\t%lu\t%lu\n", site->allocs, site->alloc_bytes, site->frees, site->live_blocks, site->live_bytes);
+#else
+		emit("\t%lu\t%lu\t%lu\n", site->allocs, site->alloc_bytes, site->frees);
+#endif
+	}
 
-		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-		printf("|Block #%-5ld has %-5ld entries:                                       |\n", block, entries->count);
+	emit_end();
+	munmap(copy.data, copy.length);
+}
 
-		for (size_t j = 0; j < entries->count; j++)
+//Must hold report_lock
+static void run_control_command(int fd, char *command)
+{
+	char *arg = strchr(command, ' ');
+	if (arg != NULL) *arg++ = '\0';
+
+	if (strcmp(command, "report") == 0)
+		write_report(fd, 0);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	else if (strcmp(command, "block") == 0 && arg != NULL)
+		write_block_report(strtoul(arg, NULL, 10), fd, 0);
+#endif
+	else if (strcmp(command, "snapshot") == 0)
+		write_callsite_snapshot(fd);
+	else if (strcmp(command, "reset") == 0)
+	{
+		reset_alloc_check_counters();
+		control_reply(fd, "ok\n");
+	}
+	else if (strcmp(command, "sample") == 0)
+	{
+		size_t every = arg != NULL ? strtoul(arg, NULL, 10) : 0;
+		control_reply(fd, set_alloc_check_trace_sampling(every) == 0 ? "ok\n" : "error: sample needs a rate of 1 or more\n");
+	}
+	else if (strcmp(command, "order") == 0)
+	{
+		const char *names[] = { "age", "size", "count", "callsite" };
+		int order = -1;
+		for (int i = 0; i < 4 && arg != NULL; i++)
+			if (strcmp(arg, names[i]) == 0) order = ALLOC_CHECK_ORDER_AGE + i;
+		control_reply(fd, set_alloc_check_report_order(order) == 0 ? "ok\n" : "error: order is one of age, size, count or callsite\n");
+	}
+	else if (strcmp(command, "trace") == 0)
+	{
+		//The recorder only sees events from the moment it is enabled
+		if (flight_enabled)
+			dump_alloc_check_flight_recorder(fd);
+		else
 		{
-			entry = entries->data[j];
-			if ((entry->type == ENTRY_MALLOC || entry->type == ENTRY_CALLOC) && entry->size == 0)
-			{
-				set_color(COLOR_RED, COLOR_DEFAULT, 0);
-				printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
-			}
-			else
-			{
-				set_color(COLOR_CYAN, COLOR_DEFAULT, 0);
-				printf("| -> %-7s %6s @%-18p at %-25s   |\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
-			}
+			enable_alloc_check_flight_recorder();
+			control_reply(fd, "flight recorder was off, now recording\n");
 		}
 	}
+	else if (strcmp(command, "help") == 0)
+	{
+		control_reply(fd, "report          full report\n"
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+			"block <id>      history of one block\n"
+#endif
+			"snapshot        counters as tab-separated lines\n"
+			"reset           zero all counters, live blocks are kept\n"
+			"sample <every>  keep 1 in 'every' events in the flight recorder\n"
+			"order <by>      report order, by age, size, count or callsite\n"
+			"trace           dump the flight recorder, enabling it the first time\n");
+	}
+	else
+		control_reply(fd, "error: unknown command, try help\n");
 }
-static void print_zero_reallocs(size_t *block_array, size_t zero_realloc_count)
+
+static void serve_control_client(int client)
 {
-	if (zero_realloc_count == 0)
+	char command[CONTROL_COMMAND_SIZE];
+	size_t len = 0;
+
+	while (len < CONTROL_COMMAND_SIZE - 1)
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No zero-sized reallocs.                                              |\n");
-		return;
+		ssize_t got = read(client, command + len, CONTROL_COMMAND_SIZE - 1 - len);
+		if (got <= 0) break;
+		len += got;
+		if (memchr(command + len - got, '\n', got) != NULL) break;
 	}
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===Zero-sized reallocs===                                            |\n");
+	command[len] = '\0';
+	command[strcspn(command, "\r\n")] = '\0';
+	if (command[0] == '\0') return;
 
-	for (size_t i = 0; i < zero_realloc_count; i++)
-	{
-		size_t block = block_array[i];
-		voidptr_array *entries = status.entry_lookup->data[block];
-		memory_entry *entry;
+	LOCK(report_lock);
+	run_control_command(client, command);
+	UNLOCK(report_lock);
+}
 
-		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-		printf("|Block #%-5ld has %-5ld entries:                                       |\n", block, entries->count);
+static void *control_thread(void *arg)
+{
+	(void)arg;
 
-		for (size_t j = 0; j < entries->count; j++)
+	while (1)
+	{
+		int client = accept(control.fd, NULL, NULL);
+		if (client < 0)
 		{
-			entry = entries->data[j];
-			if (entry->type == ENTRY_REALLOC && entry->size == 0)
-			{
-				set_color(COLOR_RED, COLOR_DEFAULT, 0);
-				printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->old_ptr, format_file_line(entry->file_name, entry->line));
-			}
-			else
-			{
-				set_color(COLOR_CYAN, COLOR_DEFAULT, 0);
-				printf("| -> %-7s %6s @%-18p at %-25s   |\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
-			}
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break; //Shut down by cleanup_alloc_checks
 		}
+
+		//A stuck client must not hold report_lock forever
+		struct timeval timeout = { .tv_sec = CONTROL_TIMEOUT_S, .tv_usec = 0 };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		serve_control_client(client);
+		close(client);
 	}
+
+	return NULL;
 }
 
-static void find_failed_re_allocs(size_t **failed_reallocs_v, size_t *failed_allocs, size_t *failed_reallocs)
+int enable_alloc_check_control(char *path)
 {
-	//REMINDER: Ignore zero-sized ops that return NULL, shown separately
+	LOCK(report_lock);
 
-	size_t *reallocv = NULL;
-	size_t allocc = 0, reallocc = 0;
-
-	voidptr_array *null_block = status.entry_lookup->data[0];
-
-	for (size_t i = 0; i < null_block->count; i++)
+	if (control.fd >= 0)
 	{
-		memory_entry *entry = null_block->data[i];
-
-		if ((entry->type == ENTRY_MALLOC || entry->type == ENTRY_CALLOC) && entry->size != 0) allocc++;
+		UNLOCK(report_lock);
+		return -1;
 	}
 
-	for (size_t i = 1; i < status.entry_lookup->count; i++)
-	{
-		voidptr_array *cur_block = status.entry_lookup->data[i];
+	int path_len;
+	if (path != NULL)
+		path_len = snprintf(control.path, sizeof(control.path), "%s", path);
+	else
+		path_len = snprintf(control.path, sizeof(control.path), "/tmp/alloc_check.%d.sock", (int)getpid());
 
-		for (size_t j = 0; j < cur_block->count; j++)
-		{
-			memory_entry *entry = cur_block->data[j];
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	memcpy(address.sun_path, control.path, sizeof(control.path));
 
-			if (entry->type == ENTRY_REALLOC && entry->size != 0 && entry->new_ptr == NULL) reallocc++;
-		}
-	}
+	//Only a socket left behind by an earlier run is replaced, never a regular file
+	struct stat st;
+	if (lstat(control.path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(control.path);
 
-	reallocv = malloc(reallocc * sizeof(size_t));
-	DIE_NULL(reallocv);
+	//Reports show addresses and file names, the socket is created owner-only so no one can connect
+	//between bind and a later chmod
+	int fd = path_len < (int)sizeof(control.path) ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+	mode_t old_mask = umask(0177);
+	int bound = fd >= 0 && bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+	umask(old_mask);
 
-	for (size_t i = 1, head = 0; i < status.entry_lookup->count && head < reallocc; i++)
+	if (!bound)
 	{
-		voidptr_array *cur_block = status.entry_lookup->data[i];
+		if (fd >= 0) close(fd);
+		UNLOCK(report_lock);
+		return -1;
+	}
 
-		for (size_t j = 0; j < cur_block->count; j++)
-		{
-			memory_entry *entry = cur_block->data[j];
+	control.fd = fd;
 
-			if (entry->type == ENTRY_REALLOC && entry->size != 0 && entry->new_ptr == NULL)
-			{
-				reallocv[head++] = i;
-				break;
-			}
-		}
+	//The thread is created with every signal blocked, so it never takes the program's signals or SIGPIPE
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int created = listen(fd, 8) == 0 && pthread_create(&control.thread, NULL, control_thread, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!created)
+	{
+		close(fd);
+		unlink(control.path);
+		control.fd = -1;
+		UNLOCK(report_lock);
+		return -1;
 	}
 
-	*failed_reallocs_v = reallocv;
-	*failed_allocs = allocc;
-	*failed_reallocs = reallocc;
+	UNLOCK(report_lock);
+	return 0;
 }
-static void print_failed_allocs(size_t failed_allocs)
+
+//Must not hold report_lock or status_lock, the thread may be waiting on them
+static void disable_alloc_check_control()
 {
-	if (failed_allocs == 0)
-	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No failed allocs.                                                    |\n");
-		return;
-	}
+	if (control.fd < 0) return;
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===Failed allocs===                                                  |\n");
+	shutdown(control.fd, SHUT_RDWR);
+	pthread_join(control.thread, NULL);
+	close(control.fd);
+	unlink(control.path);
+	control.fd = -1;
+}
 
-	voidptr_array *null_block = status.entry_lookup->data[0];
+//===Metrics file===
+//Counters written in the Prometheus text format for the node exporter textfile collector
+//Each write goes to a temporary file renamed over the target, so scrapes never see half a file
+#ifndef ALLOC_CHECK_METRICS_SITES
+#define ALLOC_CHECK_METRICS_SITES 32 //Heaviest callsites exported, bounds label cardinality
+#endif
+#define METRICS_DEFAULT_INTERVAL_MS 10000
 
-	set_color(COLOR_RED, COLOR_DEFAULT, 0);
-	for (size_t i = 0; i < null_block->count; i++)
-	{
-		memory_entry *entry = null_block->data[i];
+static struct
+{
+	char path[256];
+	char temp_path[256 + 8];
+	unsigned interval_ms;
+	char running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} metrics = { .running = 0, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void emit_metric_header(const char *name, const char *type, const char *help)
+{
+	emit("# HELP alloc_check_%s %s\n# TYPE alloc_check_%s %s\n", name, help, name, type);
+}
 
-		if ((entry->type == ENTRY_MALLOC || entry->type == ENTRY_CALLOC) && entry->size != 0)
-			printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
+//Label values escape backslashes, quotes and newlines
+static void emit_label_value(const char *value)
+{
+	for (const char *c = value; *c != '\0'; c++)
+	{
+		if (*c == '\\' || *c == '"') emit("\\%c", *c);
+		else if (*c == '\n') emit("\\n");
+		else emit("%c", *c);
 	}
 }
-static void print_failed_reallocs(size_t *block_array, size_t failed_reallocs)
+
+static void emit_callsite_label(callsite_stats *site)
 {
-	if (failed_reallocs == 0)
+	if (site->line == CHKD_RETURN_ADDRESS_LINE)
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No failed reallocs.                                                  |\n");
+		emit("{callsite=\"%s\"}", format_address(site->key, 45));
 		return;
 	}
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===Failed reallocs===                                                |\n");
+	emit("{callsite=\"");
+	emit_label_value(site->file_name);
+	emit(":%d\"}", site->line);
+}
+
+static void emit_type_label(type_stats *type)
+{
+	emit("{type=\"");
+	emit_label_value(type->name);
+	emit("\"}");
+}
+
+//Must hold report_lock
+static void write_metrics(int fd, counters_copy *copy)
+{
+	checker_status *totals = &copy->totals;
+	size_t failed_allocs = 0, failed_reallocs = 0, invalid_frees = 0;
 
-	for (size_t i = 0; i < failed_reallocs; i++)
+	for (size_t i = 0; i < copy->count; i++)
 	{
-		size_t block = block_array[i];
-		voidptr_array *entries = status.entry_lookup->data[block];
-		memory_entry *entry;
+		failed_allocs += copy->sites[i]->failed_allocs;
+		failed_reallocs += copy->sites[i]->failed_reallocs;
+		invalid_frees += copy->sites[i]->invalid_frees;
+	}
 
-		set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-		printf("|Block #%-5ld has %-5ld entries:                                       |\n", block, entries->count);
+	emit_begin(fd, 0);
+
+	emit_metric_header("allocs_total", "counter", "Allocations, malloc and calloc");
+	emit("alloc_check_allocs_total %lu\n", totals->alloc_count);
+	emit_metric_header("reallocs_total", "counter", "Reallocations");
+	emit("alloc_check_reallocs_total %lu\n", totals->realloc_count);
+	emit_metric_header("frees_total", "counter", "Frees");
+	emit("alloc_check_frees_total %lu\n", totals->free_count);
+	emit_metric_header("allocated_bytes_total", "counter", "Bytes requested by allocations and reallocations");
+	emit("alloc_check_allocated_bytes_total %lu\n", totals->alloc_bytes);
+	emit_metric_header("failed_allocs_total", "counter", "Allocations that returned NULL");
+	emit("alloc_check_failed_allocs_total %lu\n", failed_allocs);
+	emit_metric_header("failed_reallocs_total", "counter", "Reallocations that returned NULL");
+	emit("alloc_check_failed_reallocs_total %lu\n", failed_reallocs);
+	emit_metric_header("invalid_frees_total", "counter", "Double frees and frees of pointers never allocated");
+	emit("alloc_check_invalid_frees_total %lu\n", invalid_frees);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit_metric_header("live_blocks", "gauge", "Blocks currently allocated");
+	emit("alloc_check_live_blocks %lu\n", totals->live.count);
+	emit_metric_header("live_bytes", "gauge", "Bytes currently allocated");
+	emit("alloc_check_live_bytes %lu\n", totals->live_bytes);
+	emit_metric_header("peak_bytes", "gauge", "Most bytes allocated at once");
+	emit("alloc_check_peak_bytes %lu\n", totals->peak_bytes);
+#endif
+
+	//Per CHKD_NEW type, bounded by the descriptors in the program
+	emit_metric_header("type_allocs_total", "counter", "Allocations per type");
+	for (size_t i = 0; i < copy->type_count; i++)
+	{
+		emit("alloc_check_type_allocs_total");
+		emit_type_label(&copy->types[i]);
+		emit(" %lu\n", copy->types[i].allocs);
+	}
+	emit_metric_header("type_allocated_bytes_total", "counter", "Bytes allocated per type");
+	for (size_t i = 0; i < copy->type_count; i++)
+	{
+		emit("alloc_check_type_allocated_bytes_total");
+		emit_type_label(&copy->types[i]);
+		emit(" %lu\n", copy->types[i].alloc_bytes);
+	}
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit_metric_header("type_live_blocks", "gauge", "Blocks currently allocated per type");
+	for (size_t i = 0; i < copy->type_count; i++)
+	{
+		emit("alloc_check_type_live_blocks");
+		emit_type_label(&copy->types[i]);
+		emit(" %lu\n", copy->types[i].live_blocks);
+	}
+	emit_metric_header("type_live_bytes", "gauge", "Bytes currently allocated per type");
+	for (size_t i = 0; i < copy->type_count; i++)
+	{
+		emit("alloc_check_type_live_bytes");
+		emit_type_label(&copy->types[i]);
+		emit(" %lu\n", copy->types[i].live_bytes);
+	}
+	emit_metric_header("type_peak_bytes", "gauge", "Most bytes allocated at once per type");
+	for (size_t i = 0; i < copy->type_count; i++)
+	{
+		emit("alloc_check_type_peak_bytes");
+		emit_type_label(&copy->types[i]);
+		emit(" %lu\n", copy->types[i].peak_bytes);
+	}
+#endif
 
-		for (size_t j = 0; j < entries->count; j++)
-		{
-			entry = entries->data[j];
-			if (entry->type == ENTRY_REALLOC && entry->size != 0 && entry->new_ptr == NULL)
-			{
-				set_color(COLOR_RED, COLOR_DEFAULT, 0);
-				printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->old_ptr, format_file_line(entry->file_name, entry->line));
-			}
-			else
-			{
-				set_color(COLOR_CYAN, COLOR_DEFAULT, 0);
-				printf("| -> %-7s %6s @%-18p at %-25s   |\n", entry_type_str(entry->type), format_size(entry->size), entry->new_ptr, format_file_line(entry->file_name, entry->line));
-			}
-		}
+	//Per callsite, the heaviest ones only
+	callsite_stats *top[ALLOC_CHECK_METRICS_SITES];
+	size_t top_count = select_top_callsites(copy->sites, copy->count, top, ALLOC_CHECK_METRICS_SITES);
+
+	emit_metric_header("callsite_allocs_total", "counter", "Allocations per callsite");
+	for (size_t i = 0; i < top_count; i++)
+	{
+		emit("alloc_check_callsite_allocs_total");
+		emit_callsite_label(top[i]);
+		emit(" %lu\n", top[i]->allocs);
+	}
+	emit_metric_header("callsite_allocated_bytes_total", "counter", "Bytes allocated per callsite");
+	for (size_t i = 0; i < top_count; i++)
+	{
+		emit("alloc_check_callsite_allocated_bytes_total");
+		emit_callsite_label(top[i]);
+		emit(" %lu\n", top[i]->alloc_bytes);
 	}
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	emit_metric_header("callsite_live_bytes", "gauge", "Bytes currently allocated per callsite");
+	for (size_t i = 0; i < top_count; i++)
+	{
+		emit("alloc_check_callsite_live_bytes");
+		emit_callsite_label(top[i]);
+		emit(" %lu\n", top[i]->live_bytes);
+	}
+#endif
+
+	emit_end();
 }
 
-static void find_null_reallocs_frees(size_t *null_reallocs, size_t *null_frees)
+static void write_metrics_file()
 {
-	size_t reallocc = 0, freec = 0;
-
-	voidptr_array *null_block = status.entry_lookup->data[0];
+	counters_copy copy;
+	if (!copy_counters(&copy)) return;
 
-	for (size_t i = 0; i < null_block->count; i++)
+	//Renamed over the target, which gets the temporary file's owner-only mode
+	int fd = open(metrics.temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0 && fchmod(fd, 0600) == 0)
 	{
-		memory_entry *entry = null_block->data[i];
+		LOCK(report_lock);
+		write_metrics(fd, &copy);
+		UNLOCK(report_lock);
 
-		if (entry->type == ENTRY_FREE) freec++;
-		else if (entry->type == ENTRY_REALLOC) reallocc++;
+		close(fd);
+		rename(metrics.temp_path, metrics.path);
 	}
+	else if (fd >= 0)
+		close(fd);
 
-	*null_reallocs = reallocc;
-	*null_frees = freec;
+	munmap(copy.data, copy.length);
 }
-static void print_null_reallocs(size_t null_reallocs)
+
+static void *metrics_thread(void *arg)
 {
-	if (null_reallocs == 0)
+	(void)arg;
+
+	pthread_mutex_lock(&metrics.lock);
+	while (metrics.running)
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No NULL reallocs.                                                    |\n");
-		return;
+		pthread_mutex_unlock(&metrics.lock);
+		write_metrics_file();
+		pthread_mutex_lock(&metrics.lock);
+
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += metrics.interval_ms / 1000;
+		until.tv_nsec += (metrics.interval_ms % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		//Woken early only to stop
+		while (metrics.running && pthread_cond_timedwait(&metrics.wake, &metrics.lock, &until) == 0);
 	}
+	pthread_mutex_unlock(&metrics.lock);
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===NULL reallocs===                                                  |\n");
+	return NULL;
+}
 
-	voidptr_array *null_block = status.entry_lookup->data[0];
+int enable_alloc_check_metrics(char *path, unsigned interval_ms)
+{
+	pthread_mutex_lock(&metrics.lock);
 
-	set_color(COLOR_RED, COLOR_DEFAULT, 0);
-	for (size_t i = 0; i < null_block->count; i++)
+	if (metrics.running || path == NULL || strlen(path) >= sizeof(metrics.path))
 	{
-		memory_entry *entry = null_block->data[i];
-
-		if (entry->type == ENTRY_REALLOC && entry->old_ptr == NULL)
-			printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->old_ptr, format_file_line(entry->file_name, entry->line));
+		pthread_mutex_unlock(&metrics.lock);
+		return -1;
 	}
+
+	//The collector only reads *.prom files, the temporary one is skipped
+	snprintf(metrics.path, sizeof(metrics.path), "%s", path);
+	snprintf(metrics.temp_path, sizeof(metrics.temp_path), "%s.tmp", path);
+	metrics.interval_ms = interval_ms != 0 ? interval_ms : METRICS_DEFAULT_INTERVAL_MS;
+	metrics.running = 1;
+
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&metrics.thread, NULL, metrics_thread, NULL) != 0) metrics.running = 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	int result = metrics.running ? 0 : -1;
+	pthread_mutex_unlock(&metrics.lock);
+	return result;
 }
-static void print_null_frees(size_t null_frees)
+
+//Must not hold report_lock or status_lock, removes the file so a dead process is not scraped
+static void disable_alloc_check_metrics()
 {
-	if (null_frees == 0)
+	pthread_mutex_lock(&metrics.lock);
+	if (!metrics.running)
 	{
-		set_color(COLOR_GREEN, COLOR_DEFAULT, 0);
-		printf("| No NULL frees.                                                       |\n");
+		pthread_mutex_unlock(&metrics.lock);
 		return;
 	}
+	metrics.running = 0;
+	pthread_cond_signal(&metrics.wake);
+	pthread_mutex_unlock(&metrics.lock);
 
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("| ===NULL frees===                                                     |\n");
+	pthread_join(metrics.thread, NULL);
+	unlink(metrics.path);
+	unlink(metrics.temp_path);
+}
+#else
+int enable_alloc_check_control(char *path)
+{
+	(void)path;
+	return -1;
+}
 
-	voidptr_array *null_block = status.entry_lookup->data[0];
+int enable_alloc_check_metrics(char *path, unsigned interval_ms)
+{
+	(void)path;
+	(void)interval_ms;
+	return -1;
+}
 
-	set_color(COLOR_RED, COLOR_DEFAULT, 0);
-	for (size_t i = 0; i < null_block->count; i++)
-	{
-		memory_entry *entry = null_block->data[i];
+static void disable_alloc_check_control() { }
+static void disable_alloc_check_metrics() { }
+#endif
 
-		if (entry->type == ENTRY_FREE && entry->old_ptr == NULL)
-			printf("|>>> %-7s %6s @%-18p at %-25s<<<|\n", entry_type_str(entry->type), format_size(entry->size), entry->old_ptr, format_file_line(entry->file_name, entry->line));
-	}
-}
+void cleanup_alloc_checks()
+{
+	disable_alloc_check_control();
+	disable_alloc_check_metrics();
+	disable_alloc_check_async();
 
+	LOCK(status_lock);
 
+	if (status.callsites.data == NULL)
+	{
+		UNLOCK(status_lock);
+		return;
+	}
 
-void report_alloc_checks()
-{
-	init_checker();
+	drain_async_queues(SIZE_MAX);
+	__atomic_add_fetch(&tracker_generation, 1, __ATOMIC_RELEASE);
 
-	//Calculate metrics
-	size_t allocs = status.allocs->count;
-	size_t reallocs = status.reallocs->count;
-	size_t frees = status.frees->count;
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	for (size_t i = 0; i < status.entry_lookup->count; i++)
+	{
+		voidptr_array *entries = status.entry_lookup->data[i];
+		if (entries == NULL) continue;
 
-	size_t blocks_lost, memory_lost, *lost_blocks_v;
-	find_lost_blocks(&lost_blocks_v, &blocks_lost, &memory_lost);
+		for (size_t j = 0; j < entries->count; j++)
+			destroy_memory_entry(entries->data[j]);
 
-	size_t zero_allocs, zero_reallocs, *zero_allocs_v, *zero_reallocs_v;
-	find_zero_re_allocs(&zero_allocs_v, &zero_reallocs_v, &zero_allocs, &zero_reallocs);
-	
-	size_t failed_allocs, failed_reallocs, *failed_reallocs_v;
-	find_failed_re_allocs(&failed_reallocs_v, &failed_allocs, &failed_reallocs);
+		destroy_voidptr_array(entries);
+	}
 
-	size_t null_reallocs, null_frees;
-	find_null_reallocs_frees(&null_reallocs, &null_frees);
+	destroy_voidptr_array(status.entry_lookup);
+	meta_free(status.entry_ids);
+	destroy_voidptr_array(status.kept);
+	status.entry_lookup = NULL;
+	status.entry_ids = NULL;
+	status.kept = NULL;
+	status.spill_lost = 0;
+	disable_alloc_check_history_spill();
+#endif
 
-	//Internally 70 cols wide (72 external)
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("\n\n");
-	printf("+=========================alloc_check report===========================+\n");
-	printf("+--Statistics----------------------------------------------------------+\n");
-	set_color(COLOR_WHITE, COLOR_DEFAULT, 0);
-	printf("|Total allocs/reallocs/frees: %-5ld/%-5ld/%-5ld                        |\n", allocs, reallocs, frees);
-	printf("|Total blocks/memory lost: %-5ld/~%-6s                               |\n", blocks_lost, format_size(memory_lost));
-	printf("|Total zero-sized allocs/reallocs: %-5ld/%-5ld                         |\n", zero_allocs, zero_reallocs);
-	printf("|Total failed allocs/reallocs: %-5ld/%-5ld                             |\n", failed_allocs, failed_reallocs);
-	printf("|Total NULL reallocs/frees: %-5ld/%-5ld                                |\n", null_reallocs, null_frees);
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("+--Missing frees-------------------------------------------------------+\n");
-	print_missing_frees(lost_blocks_v, blocks_lost);
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("+--Invalid operations--------------------------------------------------+\n");
-	print_zero_allocs(zero_allocs_v, zero_allocs);
-	print_zero_reallocs(zero_reallocs_v, zero_reallocs);
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("+--Failed (re)allocations----------------------------------------------+\n");
-	print_failed_allocs(failed_allocs);
-	print_failed_reallocs(failed_reallocs_v, failed_reallocs);
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("+--Possible mistakes---------------------------------------------------+\n");
-	print_null_reallocs(null_reallocs);
-	print_null_frees(null_frees);
-	set_color(COLOR_ORANGE, COLOR_DEFAULT, 0);
-	printf("+======================================================================+\n");
-	set_color(COLOR_DEFAULT, COLOR_DEFAULT, 0);
+	for (int i = 0; i < NULL_OP_COUNT; i++)
+	{
+		voidptr_array *sample = status.null_samples[i];
 
-	free(lost_blocks_v);
-	free(zero_allocs_v);
-	free(zero_reallocs_v);
-	free(failed_reallocs_v);
-}
+		for (size_t j = 0; j < sample->count; j++)
+			destroy_memory_entry(sample->data[j]);
 
-void cleanup_alloc_checks()
-{
-	for (size_t i = 0; i < status.allocs->count; i++)
-		destroy_memory_entry(status.allocs->data[i]);
+		destroy_voidptr_array(sample);
+		status.null_samples[i] = NULL;
+		status.null_seen[i] = 0;
+	}
 
-	for (size_t i = 0; i < status.reallocs->count; i++)
-		destroy_memory_entry(status.reallocs->data[i]);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	destroy_live_index(&status.live);
+	status.id_counter = 0;
+	status.live_bytes = 0;
+	status.peak_bytes = 0;
+#endif
 
-	for (size_t i = 0; i < status.frees->count; i++)
-		destroy_memory_entry(status.frees->data[i]);
+#if ALLOC_CHECK_THREAD_SAFE
+	for (int i = 0; i < status.thread_count; i++)
+	{
+		pid_t tid = status.threads[i].tid;
+		memset(&status.threads[i], 0, sizeof(thread_stats));
+		status.threads[i].tid = tid;
+	}
+#endif
+
+	//Pools still alive belong to the program, they are only forgotten
+	for (chkd_pool *pool = status.pools; pool != NULL; pool = pool->next)
+		pool->registered = 0;
+	status.pools = NULL;
+	status.pool_count = 0;
+	status.pools_created = 0;
+	status.pools_destroyed = 0;
+
+	for (chkd_arena *arena = status.arenas; arena != NULL; arena = arena->next)
+		arena->registered = 0;
+	status.arenas = NULL;
+	status.arena_count = 0;
+	status.arenas_created = 0;
+	status.arenas_destroyed = 0;
+
+	while (status.types != NULL)
+	{
+		type_stats *next = status.types->next;
+		meta_free(status.types);
+		status.types = next;
+	}
+	status.type_count = 0;
 
-	for (size_t i = 0; i < status.entry_lookup->count; i++)
-		destroy_voidptr_array(status.entry_lookup->data[i]);
+	destroy_callsite_table(&status.callsites);
+	status.alloc_count = 0;
+	status.realloc_count = 0;
+	status.free_count = 0;
+	status.alloc_bytes = 0;
 
-	destroy_voidptr_array(status.allocs);
-	destroy_voidptr_array(status.reallocs);
-	destroy_voidptr_array(status.frees);
-	destroy_voidptr_array(status.pointers);
-	destroy_voidptr_array(status.entry_lookup);
+	disable_alloc_check_mmap();
+	disable_alloc_check_shm();
 
-	status.id_counter = 0;
-	status.allocs = NULL;
-	status.reallocs = NULL;
-	status.frees = NULL;
-	status.pointers = NULL;
-	status.entry_lookup = NULL;
+	UNLOCK(status_lock);
 }
+#endif
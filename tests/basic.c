@@ -0,0 +1,48 @@
+//A leak, a realloc and a double free, and what each level reports about them
+
+#include "check.h"
+
+
+static void report(void *arg)
+{
+	(void)arg;
+	report_alloc_checks();
+}
+
+int main()
+{
+	char *leak = CHKD_MALLOC(100);
+	CHECK(leak != NULL);
+
+	char *block = CHKD_MALLOC(10);
+	CHECK(block != NULL);
+	memcpy(block, "alloc_chk", 10);
+	block = CHKD_REALLOC(block, 1000);
+	CHECK(block != NULL && strcmp(block, "alloc_chk") == 0);
+
+	//Freed again through a volatile copy, the compiler cannot tell it is the same block
+	char *volatile stale = block;
+	CHKD_FREE(block);
+	kept_from_libc = stale;
+	CHKD_FREE(stale);
+
+	char *text = capture(report, NULL);
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF
+	CHECK(text[0] == '\0');
+#else
+	//Without the live set the double free counts as a regular free
+	CHECK(strstr(text, "Total allocs/reallocs/frees: 2    /1    /2 ") != NULL);
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	CHECK(strstr(text, "Total blocks/memory lost: 1    /~100B ") != NULL);
+	CHECK(strstr(text, "Total invalid/double frees: 1 ") != NULL);
+	CHECK(strstr(text, "100B @0x") != NULL);
+	CHECK(strstr(text, "===Invalid or double frees===") != NULL);
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	CHECK(strstr(text, "Block #1    : 100B  , has 1     entries:") != NULL);
+#endif
+
+	cleanup_alloc_checks();
+	return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file check.h
+ *
+ * @brief Helpers shared by the tests, each test is one program built once per ALLOC_CHECK_LEVEL
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc_check.h"
+
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+#define REPORT_SIZE 0x10000
+
+//Tests are linked with --wrap=free, so a double free is recorded by alloc_check and then kept from libc
+void *kept_from_libc = NULL;
+void __real_free(void *ptr);
+void __wrap_free(void *ptr)
+{
+	if (ptr == NULL || ptr != kept_from_libc) __real_free(ptr);
+}
+
+//Runs 'report' with stdout sent to a temporary file, returns what it printed, truncated to REPORT_SIZE - 1 bytes
+static inline char *capture(void (*report)(void *), void *arg)
+{
+	static char text[REPORT_SIZE];
+
+	fflush(stdout);
+	FILE *file = tmpfile();
+	CHECK(file != NULL);
+	int saved = dup(STDOUT_FILENO);
+	CHECK(saved >= 0 && dup2(fileno(file), STDOUT_FILENO) >= 0);
+
+	report(arg);
+
+	fflush(stdout);
+	CHECK(dup2(saved, STDOUT_FILENO) >= 0);
+	close(saved);
+
+	rewind(file);
+	size_t length = fread(text, 1, REPORT_SIZE - 1, file);
+	text[length] = '\0';
+	fclose(file);
+
+	return text;
+}
+
+//A path under the temporary directory unique to this process
+static inline char *temp_path(char *name)
+{
+	static char path[256];
+	char *dir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/alloc_check_test.%d.%s", dir != NULL ? dir : "/tmp", (int)getpid(), name);
+	return path;
+}
+
+#endif
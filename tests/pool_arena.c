@@ -0,0 +1,61 @@
+//Pool and arena blocks, oversized requests fail and are counted instead of wrapping around
+
+#include <stdint.h>
+
+#include "check.h"
+
+
+static void report(void *arg)
+{
+	(void)arg;
+	report_alloc_checks();
+}
+
+int main()
+{
+	chkd_pool *pool = CHKD_POOL_CREATE("test pool");
+	CHECK(pool != NULL);
+	char *pooled = chkd_pool_alloc(pool, 40);
+	CHECK(pooled != NULL && ((uintptr_t)pooled & 15) == 0);
+	memset(pooled, 1, 40);
+	CHECK(chkd_pool_alloc(pool, SIZE_MAX) == NULL);
+	CHECK(chkd_pool_alloc(pool, SIZE_MAX - 15) == NULL);
+
+	chkd_arena *arena = CHKD_ARENA_CREATE("test arena");
+	CHECK(arena != NULL);
+	char *bumped = chkd_arena_alloc(arena, 64);
+	CHECK(bumped != NULL && ((uintptr_t)bumped & 15) == 0);
+	memset(bumped, 1, 64);
+	CHECK(chkd_arena_alloc(arena, SIZE_MAX - 8) == NULL);
+
+	char *text = capture(report, NULL);
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF
+	CHECK(text[0] == '\0');
+#else
+	CHECK(strstr(text, "Total pools created/destroyed: 1    /0 ") != NULL);
+	CHECK(strstr(text, "Total arenas created/destroyed: 1    /0 ") != NULL);
+	CHECK(strstr(text, "|Pool test pool ") != NULL);
+	CHECK(strstr(text, "|    x2        failed allocs ") != NULL);
+	CHECK(strstr(text, "|Arena test arena ") != NULL);
+	CHECK(strstr(text, "|    x1        failed allocs ") != NULL);
+#endif
+
+	chkd_arena_reset(arena);
+	CHECK(chkd_arena_alloc(arena, 4096) != NULL);
+	chkd_arena_destroy(arena);
+	chkd_pool_destroy(pool);
+
+	text = capture(report, NULL);
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF
+	CHECK(text[0] == '\0');
+#else
+	CHECK(strstr(text, "Total pools created/destroyed: 1    /1 ") != NULL);
+	CHECK(strstr(text, "Total arenas created/destroyed: 1    /1 ") != NULL);
+#endif
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	CHECK(strstr(text, "Total blocks/memory lost: 0    /~0B ") != NULL);
+#endif
+
+	cleanup_alloc_checks();
+	return 0;
+}
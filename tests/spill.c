@@ -0,0 +1,47 @@
+//Histories of freed blocks moved to disk and read back by report_alloc_check_block
+
+#include "check.h"
+
+
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+static void report_block(void *arg)
+{
+	report_alloc_check_block(*(size_t *)arg);
+}
+#endif
+
+int main()
+{
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_FULL
+	char *path = temp_path("spill");
+	CHECK(enable_alloc_check_history_spill(path) == 0);
+
+	for (int i = 0; i < 3; i++)
+	{
+		char *block = CHKD_MALLOC(8);
+		CHECK(block != NULL);
+		block = CHKD_REALLOC(block, 16);
+		CHECK(block != NULL);
+		CHKD_FREE(block);
+	}
+	char *live = CHKD_MALLOC(32);
+	CHECK(live != NULL);
+
+	size_t id = 2;
+	char *text = capture(report_block, &id);
+	CHECK(strstr(text, "|Block #2     has 3     entries (3     from disk):") != NULL);
+	CHECK(strstr(text, "| -> MALLOC      8B @0x") != NULL);
+	CHECK(strstr(text, "| -> REALLOC    16B @0x") != NULL);
+	CHECK(strstr(text, "| -> FREE        0B @0x") != NULL);
+
+	id = 4;
+	text = capture(report_block, &id);
+	CHECK(strstr(text, "|Block #4     has 1     entries (0     from disk):") != NULL);
+
+	CHKD_FREE(live);
+	cleanup_alloc_checks();
+	unlink(path);
+#endif
+	//Nothing to spill below full level, histories are not kept
+	return 0;
+}
@@ -0,0 +1,48 @@
+//The crash-safe state file of a killed process, read back by report_alloc_check_mmap
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "check.h"
+
+
+static void report_state(void *arg)
+{
+	report_alloc_check_mmap(arg);
+}
+
+int main()
+{
+	char *path = temp_path("state");
+
+#if ALLOC_CHECK_LEVEL == ALLOC_CHECK_LEVEL_OFF
+	CHECK(enable_alloc_check_mmap(path, 16) == -1);
+	return 0;
+#endif
+
+	fflush(stdout);
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0)
+	{
+		if (enable_alloc_check_mmap(path, 16) != 0) _exit(1);
+		char *leak = CHKD_MALLOC(77);
+		if (leak == NULL) _exit(1);
+		raise(SIGKILL);
+	}
+
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+	char *text = capture(report_state, path);
+	CHECK(strstr(text, "ended without cleanup (crash?).") != NULL);
+	CHECK(strstr(text, "|Total events/kept: 1         /1 ") != NULL);
+#if ALLOC_CHECK_LEVEL >= ALLOC_CHECK_LEVEL_SUMMARY
+	CHECK(strstr(text, "|Live blocks/memory: 1    /~77B ") != NULL);
+	CHECK(strstr(text, "77B @0x") != NULL);
+#endif
+
+	unlink(path);
+	return 0;
+}
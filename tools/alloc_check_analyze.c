@@ -0,0 +1,30 @@
+/**
+ * @file alloc_check_analyze.c
+ * 
+ * @brief Offline reader for alloc_check state files
+ * 
+ * @author Diogo Cruz Diniz
+ * Contact: diogo.cruz.diniz@tecnico.ulisboa.pt
+ */
+
+
+
+#include "alloc_check.h"
+
+#include <stdio.h>
+
+
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <state file>...\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 1; i < argc; i++)
+		report_alloc_check_mmap(argv[i]);
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/**
+ * @file alloc_check_top.c
+ *
+ * @brief Live viewer for the statistics published by enable_alloc_check_shm
+ *
+ * @author Diogo Cruz Diniz
+ * Contact: diogo.cruz.diniz@tecnico.ulisboa.pt
+ */
+
+
+
+#include "alloc_check_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+static char *format_bytes(char *buff, size_t buff_size, double bytes)
+{
+	const char *units[] = { "B", "kB", "MB", "GB", "TB" };
+	int unit = 0;
+
+	while (bytes >= 1024 && unit < 4)
+	{
+		bytes /= 1024;
+		unit++;
+	}
+
+	snprintf(buff, buff_size, unit == 0 ? "%.0f%s" : "%.1f%s", bytes, units[unit]);
+	return buff;
+}
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *level_name(uint64_t level)
+{
+	if (level == 1) return "counters";
+	if (level == 2) return "summary";
+	if (level == 3) return "full";
+	if (level == 4) return "stacks";
+	return "?";
+}
+
+static void print_screen(alloc_check_shm *now, alloc_check_shm *before, double elapsed)
+{
+	char a[16], b[16];
+
+	//Home and clear, redrawn in place
+	printf("\033[H\033[2J");
+	printf("alloc_check_top - pid %ld, level %s%s\n\n", (long)now->pid, level_name(now->level),
+		now->state == ALLOC_CHECK_SHM_CLEAN ? ", finished" : "");
+
+	printf("Allocs/s: %-10.0f Reallocs/s: %-10.0f Frees/s: %-10.0f Allocated/s: %s\n",
+		(now->alloc_count - before->alloc_count) / elapsed,
+		(now->realloc_count - before->realloc_count) / elapsed,
+		(now->free_count - before->free_count) / elapsed,
+		format_bytes(a, sizeof(a), (now->alloc_bytes - before->alloc_bytes) / elapsed));
+	printf("Totals:   %lu allocs, %lu reallocs, %lu frees, %s allocated\n",
+		(unsigned long)now->alloc_count, (unsigned long)now->realloc_count, (unsigned long)now->free_count,
+		format_bytes(a, sizeof(a), now->alloc_bytes));
+
+	if (now->level >= 2)
+		printf("Live:     %lu blocks, %s (peak %s)\n", (unsigned long)now->live_blocks,
+			format_bytes(a, sizeof(a), now->live_bytes), format_bytes(b, sizeof(b), now->peak_bytes));
+
+	printf("\nTop %lu of %lu callsites, by %s:\n", (unsigned long)now->top_count, (unsigned long)now->site_count,
+		now->level >= 2 ? "live bytes" : "allocated bytes");
+	printf("%12s %12s %12s %12s  %s\n", "LIVE", "LIVE BLOCKS", "ALLOCATED", "ALLOCS", "CALLSITE");
+
+	for (uint64_t i = 0; i < now->top_count && i < ALLOC_CHECK_SHM_TOP; i++)
+	{
+		alloc_check_shm_site *site = &now->top[i];
+
+		printf("%12s %12lu %12s %12lu  %s", format_bytes(a, sizeof(a), site->live_bytes), (unsigned long)site->live_blocks,
+			format_bytes(b, sizeof(b), site->alloc_bytes), (unsigned long)site->allocs, site->file_name);
+		if (site->line >= 0) printf(":%d", site->line);
+		printf("\n");
+	}
+
+	if (now->type_count == 0)
+	{
+		fflush(stdout);
+		return;
+	}
+
+	printf("\nTop %lu of %lu types, by %s:\n", (unsigned long)now->top_type_count, (unsigned long)now->type_count,
+		now->level >= 2 ? "live bytes" : "allocated bytes");
+	printf("%12s %12s %12s %12s %12s  %s\n", "LIVE", "LIVE BLOCKS", "PEAK", "ALLOCATED", "ALLOCS", "TYPE");
+
+	for (uint64_t i = 0; i < now->top_type_count && i < ALLOC_CHECK_SHM_TYPES; i++)
+	{
+		alloc_check_shm_type *type = &now->types[i];
+		char c[16];
+
+		printf("%12s %12lu %12s %12s %12lu  %s (%luB)\n", format_bytes(a, sizeof(a), type->live_bytes), (unsigned long)type->live_blocks,
+			format_bytes(b, sizeof(b), type->peak_bytes), format_bytes(c, sizeof(c), type->alloc_bytes), (unsigned long)type->allocs,
+			type->name, (unsigned long)type->size);
+	}
+
+	fflush(stdout);
+}
+
+//Retries while the process is alive, returns -1 if it died and left the segment mid-update
+static int read_segment(const alloc_check_shm *shm, alloc_check_shm *out, char *name)
+{
+	while (read_alloc_check_shm(shm, out) != 0)
+	{
+		//The pid is written once, before the first update
+		if (kill((pid_t)shm->pid, 0) != 0 && errno == ESRCH)
+		{
+			printf("\nProcess exited during an update, remove /dev/shm%s when done.\n", name);
+			return -1;
+		}
+
+		struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+		nanosleep(&delay, NULL);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <pid | segment name> [interval ms]\n", argv[0]);
+		return 1;
+	}
+
+	char name[64];
+	if (isdigit((unsigned char)argv[1][0]))
+		snprintf(name, sizeof(name), "/alloc_check.%s", argv[1]);
+	else
+		snprintf(name, sizeof(name), "%s", argv[1]);
+
+	long interval = argc > 2 ? atol(argv[2]) : 1000;
+	if (interval <= 0) interval = 1000;
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr, "alloc_check_top: could not open '%s', was enable_alloc_check_shm called?\n", name);
+		return 1;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(alloc_check_shm))
+		map = mmap(NULL, sizeof(alloc_check_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	alloc_check_shm *shm = map;
+	if (map == MAP_FAILED || memcmp(shm->magic, ALLOC_CHECK_SHM_MAGIC, 8) != 0 ||
+		shm->version != ALLOC_CHECK_SHM_VERSION || shm->size != sizeof(alloc_check_shm))
+	{
+		fprintf(stderr, "alloc_check_top: '%s' is not a compatible segment.\n", name);
+		if (map != MAP_FAILED) munmap(map, sizeof(alloc_check_shm));
+		return 1;
+	}
+
+	alloc_check_shm before, now;
+	if (read_segment(shm, &before, name) != 0)
+	{
+		munmap(map, sizeof(alloc_check_shm));
+		return 1;
+	}
+	double last = now_seconds();
+
+	//Only reads the mapping, kill with signal 0 just probes that the process still exists
+	while (1)
+	{
+		struct timespec delay = { .tv_sec = interval / 1000, .tv_nsec = (interval % 1000) * 1000000 };
+		nanosleep(&delay, NULL);
+
+		if (read_segment(shm, &now, name) != 0) break;
+		double current = now_seconds();
+		print_screen(&now, &before, current - last);
+
+		if (now.state == ALLOC_CHECK_SHM_CLEAN) break;
+		if (kill((pid_t)now.pid, 0) != 0 && errno == ESRCH)
+		{
+			printf("\nProcess exited without cleanup, remove /dev/shm%s when done.\n", name);
+			break;
+		}
+
+		before = now;
+		last = current;
+	}
+
+	munmap(map, sizeof(alloc_check_shm));
+	return 0;
+}